@@ -6,6 +6,8 @@
 
 #include <iostream>
 
+#include "../video_input/lbf_model.hpp"
+
 using namespace std;
 using namespace cv;
 using namespace cv::face;
@@ -14,6 +16,7 @@ void detectFaceEyesAndDisplay( Mat frame );
 void isolate( Mat frame, vector<Point2f> landmarks);
 CascadeClassifier face_cascade;
 CascadeClassifier eyes_cascade;
+Ptr<Facemark> facemark;
 
 int main( int argc, const char** argv )
 {
@@ -31,6 +34,12 @@ int main( int argc, const char** argv )
         return -1;
     };
 
+    // loaded once, before any image is processed
+    String facemark_filename = findLbfModel();
+    facemark = createFacemarkLBF();
+    facemark -> loadModel(facemark_filename);
+    cout << "Loaded facemark LBF model" << endl;
+
     Mat image;
     image = imread("bauka.png");
 
@@ -133,12 +142,6 @@ void detectFaceEyesAndDisplay( Mat frame )
 
     }
 
-    String facemark_filename = "../models/lbfmodel.yaml";
-
-    Ptr<Facemark> facemark = createFacemarkLBF();
-    facemark -> loadModel(facemark_filename);
-    cout << "Loaded facemark LBF model" << endl;
-
     cv::rectangle(frame, faces[0], Scalar(255, 0, 0), 2);
     vector<vector<Point2f>> shapes;
     
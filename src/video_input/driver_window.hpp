@@ -0,0 +1,167 @@
+#ifndef DRIVER_WINDOW_HPP
+#define DRIVER_WINDOW_HPP
+
+#include "opencv2/videoio.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+// Default horizons over which the share of closed-eye (PERCLOS) and yawning frames is
+// reported. The first one drives the alert, once the window has seen a whole horizon of frames.
+const int N_HORIZONS = 3;
+const double HORIZON_MS[N_HORIZONS] = {1000, 10000, 60000};
+const char* const BLINK_HORIZON_FIELDS[N_HORIZONS] = {"perclos_1s", "perclos_10s", "perclos_60s"};
+const char* const YAW_HORIZON_FIELDS[N_HORIZONS] = {"yaw_1s", "yaw_10s", "yaw_60s"};
+
+const float ALERT_DROWSINESS_PERC = 0.8;
+
+// One frame in the window, with the number of flagged frames before it
+struct WindowSample {
+    double time_ms;
+    long blinks_before;
+    long yawns_before;
+};
+
+// Sliding windows over the frame timestamps, so the percentages do not depend on the
+// frame rate. All horizons share one ring of samples holding running totals: the share of a
+// horizon is the total now minus the total before its oldest frame, and every horizon start
+// only moves forward, so an update costs O(1) amortized whatever the horizon lengths.
+struct DriverWindow {
+    double horizon_ms[N_HORIZONS] = {HORIZON_MS[0], HORIZON_MS[1], HORIZON_MS[2]};
+
+    std::vector<WindowSample> samples;  // sample k is stored at samples[k % samples.size()]
+    long n_samples = 0;
+    long total_blinks = 0;
+    long total_yawns = 0;
+    long start[N_HORIZONS] = {0, 0, 0};  // oldest sample inside each horizon
+    double first_ms = 0;                 // time of the first sample since the last reset
+    bool horizon_complete[N_HORIZONS] = {false, false, false};  // the frames cover the horizon
+
+    float horizon_drowsiness[N_HORIZONS] = {0, 0, 0};
+    float horizon_yaw[N_HORIZONS] = {0, 0, 0};
+    float drowsiness_perc = 0.0;  // shortest horizon
+    float yaw_perc = 0.0;
+};
+
+// Changes the length of the alert horizon, as the threshold search does for every window
+// length it scores. The other horizons keep their lengths and may be shorter.
+// Returns false and keeps the horizon when the length is not positive.
+inline bool setAlertHorizon( DriverWindow& window, double horizon_ms )
+{
+    if (!(horizon_ms > 0))
+    {
+        return false;
+    }
+    window.horizon_ms[0] = horizon_ms;
+    return true;
+}
+
+// the horizons keep their lengths, only the samples are dropped
+inline void resetWindow( DriverWindow& window )
+{
+    window.n_samples = 0;
+    window.total_blinks = 0;
+    window.total_yawns = 0;
+    for (int h = 0; h < N_HORIZONS; h++)
+    {
+        window.start[h] = 0;
+        window.horizon_complete[h] = false;
+        window.horizon_drowsiness[h] = 0;
+        window.horizon_yaw[h] = 0;
+    }
+    window.drowsiness_perc = 0;
+    window.yaw_perc = 0;
+}
+
+inline const WindowSample& windowSample( const DriverWindow& window, long k )
+{
+    return window.samples[k % window.samples.size()];
+}
+
+// oldest sample any horizon still needs
+inline long oldestSample( const DriverWindow& window )
+{
+    long oldest = window.start[0];
+    for (int h = 1; h < N_HORIZONS; h++)
+    {
+        oldest = std::min(oldest, window.start[h]);
+    }
+    return oldest;
+}
+
+// doubles the ring while the longest horizon still needs every stored sample
+inline void growWindow( DriverWindow& window )
+{
+    std::vector<WindowSample> samples(window.samples.empty() ? 64 : 2 * window.samples.size());
+    for (long k = oldestSample(window); k < window.n_samples; k++)
+    {
+        samples[k % samples.size()] = windowSample(window, k);
+    }
+    window.samples.swap(samples);
+}
+
+// Adds the frame taken at time_ms and updates the percentages of every horizon.
+// A timestamp going backwards, as after a seek, starts the window over.
+inline void updateWindow( DriverWindow& window, double time_ms, bool is_blinking, bool is_yawning )
+{
+    if (window.n_samples > 0 && time_ms < windowSample(window, window.n_samples - 1).time_ms)
+    {
+        resetWindow(window);
+    }
+    if (window.n_samples - oldestSample(window) >= (long)window.samples.size())
+    {
+        growWindow(window);
+    }
+
+    if (window.n_samples == 0)
+    {
+        window.first_ms = time_ms;
+    }
+
+    WindowSample& sample = window.samples[window.n_samples % window.samples.size()];
+    sample.time_ms = time_ms;
+    sample.blinks_before = window.total_blinks;
+    sample.yawns_before = window.total_yawns;
+    window.n_samples++;
+    window.total_blinks += is_blinking;
+    window.total_yawns += is_yawning;
+
+    for (int h = 0; h < N_HORIZONS; h++)
+    {
+        // the newest sample always stays inside, whatever the timestamps
+        while (window.start[h] < window.n_samples - 1 &&
+               windowSample(window, window.start[h]).time_ms <= time_ms - window.horizon_ms[h])
+        {
+            window.start[h]++;
+        }
+        const WindowSample& oldest = windowSample(window, window.start[h]);
+        float n_frames = window.n_samples - window.start[h];
+        window.horizon_drowsiness[h] = (window.total_blinks - oldest.blinks_before) / n_frames;
+        window.horizon_yaw[h] = (window.total_yawns - oldest.yawns_before) / n_frames;
+        window.horizon_complete[h] = time_ms - window.first_ms >= window.horizon_ms[h];
+    }
+    window.drowsiness_perc = window.horizon_drowsiness[0];
+    window.yaw_perc = window.horizon_yaw[0];
+}
+
+// A window that has not yet covered its first horizon, as after the start or a seek,
+// holds too few frames to raise the alert: one blinking frame would be 100%.
+inline bool driverAlert( const DriverWindow& window, float alert_level = ALERT_DROWSINESS_PERC )
+{
+    return window.horizon_complete[0] && window.drowsiness_perc > alert_level;
+}
+
+// Time of the frame just read: the position in the file for videos, the steady clock
+// for cameras, which do not report a meaningful position
+inline double frameTimeMs( cv::VideoCapture& capture )
+{
+    if (capture.get(cv::CAP_PROP_FRAME_COUNT) > 0)
+    {
+        return capture.get(cv::CAP_PROP_POS_MSEC);
+    }
+    return std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+#endif
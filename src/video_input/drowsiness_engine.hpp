@@ -0,0 +1,418 @@
+#ifndef DROWSINESS_ENGINE_HPP
+#define DROWSINESS_ENGINE_HPP
+
+#include "opencv2/objdetect.hpp"
+#include "opencv2/imgproc.hpp"
+#include "opencv2/face.hpp"
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "face_tracker.hpp"
+#include "frame_pipeline.hpp"
+#include "landmark_flow.hpp"
+#include "landmark_ratios.hpp"
+#include "lbf_model.hpp"
+#include "driver_window.hpp"
+#include "stage_profile.hpp"
+#include "latency_governor.hpp"
+#include "yuv_frame.hpp"
+
+// Blink ratio analysis of a driver video: face detection, landmark fitting, blink and
+// yawn classification and the drowsiness windows. The applications use the pieces
+// directly; other programs embed it through DrowsinessEngine.
+
+const float BLINKING_RATIO_THRESHOLD = 3.8;
+const float YAWNING_RATIO_THRESHOLD = 1.7;
+
+const char* const FACE_CASCADE_PATH = "../haarcascades/haarcascade_frontalface_alt.xml";
+
+// One frame's passenger fit, pointing into the analysis of the frame
+struct PassengerFit {
+    const cv::Mat* frame_gray = NULL;
+    const std::vector<cv::Rect>* faces = NULL;
+    std::vector<std::vector<cv::Point2f> >* landmarks = NULL;
+    bool fitted = false;
+};
+
+// Thread fitting passenger faces on its own landmark model while the analysis thread
+// fits the driver. It is started once with the model and woken for each frame through
+// a pair of one-slot rings, instead of a new thread per frame.
+class PassengerWorker {
+public:
+    explicit PassengerWorker( const cv::Ptr<cv::face::Facemark>& facemark )
+        : requests(1), results(1)
+    {
+        cv::face::Facemark* model = facemark.get();
+        worker = startStage(requests, results, [model](PassengerFit& fit) {
+            fit.fitted = model -> fit(*fit.frame_gray, *fit.faces, *fit.landmarks);
+            return true;
+        });
+    }
+
+    ~PassengerWorker()
+    {
+        requests.close();
+        results.close();
+        worker.join();
+    }
+
+    // the frame, faces and landmarks must stay in place until finish() returns
+    bool start( const cv::Mat& frame_gray, const std::vector<cv::Rect>& faces,
+                std::vector<std::vector<cv::Point2f> >& landmarks )
+    {
+        PassengerFit fit;
+        fit.frame_gray = &frame_gray;
+        fit.faces = &faces;
+        fit.landmarks = &landmarks;
+        return requests.push(std::move(fit));
+    }
+
+    // waits for the fit started last; false when it failed
+    bool finish()
+    {
+        PassengerFit fit;
+        return results.pop(fit) && fit.fitted;
+    }
+
+private:
+    PassengerWorker( const PassengerWorker& );
+    PassengerWorker& operator=( const PassengerWorker& );
+
+    SpscRing<PassengerFit> requests;
+    SpscRing<PassengerFit> results;
+    std::thread worker;
+};
+
+// Face cascade and landmark model. Neither can be shared between threads,
+// so every analysis thread owns its own set.
+struct Detectors {
+    cv::CascadeClassifier face_cascade;
+    cv::Ptr<cv::face::Facemark> facemark;
+    cv::Ptr<cv::face::Facemark> passenger_facemark;  // second model for passenger mode
+    std::shared_ptr<PassengerWorker> passenger_worker;  // the thread running it
+};
+
+inline bool loadDetectors( Detectors& detectors, const std::string& cascade_path = FACE_CASCADE_PATH,
+                           const std::string& model_path = findLbfModel() )
+{
+    std::string face_cascade_name = cv::samples::findFile(cascade_path);
+
+    detectors.facemark = cv::face::createFacemarkLBF();
+    detectors.facemark -> loadModel(model_path);
+    std::cerr << "Loaded facemark LBF model" << std::endl;
+
+    if( !detectors.face_cascade.load( face_cascade_name ) )
+    {
+        std::cerr << "--(!)Error loading face cascade\n";
+        return false;
+    };
+    return true;
+}
+
+// a second landmark model, so passenger faces are fitted alongside the driver's
+inline void loadPassengerModel( Detectors& detectors, const std::string& model_path = findLbfModel() )
+{
+    detectors.passenger_facemark = cv::face::createFacemarkLBF();
+    detectors.passenger_facemark -> loadModel(model_path);
+    detectors.passenger_worker = std::make_shared<PassengerWorker>(detectors.passenger_facemark);
+}
+
+// State a video stream carries from one frame to the next
+struct StreamState {
+    FaceTracker face_tracker;
+    LandmarkFlow landmark_flow;
+    DriverWindow window;
+    StageProfile profile;
+    LatencyGovernor governor;
+    YuvLayout yuv = YUV_NONE;  // raw layout requested from the camera
+    bool passengers = false;   // also fit the faces other than the driver's
+};
+
+// Intermediate images and vectors of the analysis, kept from one frame to the next
+struct AnalysisBuffers {
+    cv::Mat gray;
+    cv::Mat equalized;
+    std::vector<cv::Rect> faces;
+    std::vector<cv::Rect> driver_face;
+    std::vector<std::vector<cv::Point2f> > shapes;
+};
+
+// Face detection and landmark fitting shared by all classifiers of a frame
+struct FrameAnalysis {
+    bool face_found;
+    cv::Rect face;
+    std::vector<cv::Point2f> landmarks;
+
+    // passenger mode: the other faces of frames with a full fit
+    std::vector<cv::Rect> passenger_faces;
+    std::vector<std::vector<cv::Point2f> > passenger_landmarks;
+};
+
+// Starts fitting the faces after the driver's on the passenger worker, in parallel with
+// the driver fit. Returns whether a fit was started, to be waited for with finishPassengers.
+inline bool startPassengers( const cv::Mat& frame_gray, Detectors& detectors, const StreamState& stream,
+                             const std::vector<cv::Rect>& faces, FrameAnalysis& analysis )
+{
+    analysis.passenger_faces.clear();
+    analysis.passenger_landmarks.clear();
+    if (!stream.passengers || faces.size() < 2 || !detectors.passenger_worker)
+    {
+        return false;
+    }
+    analysis.passenger_faces.assign(faces.begin() + 1, faces.end());
+    return detectors.passenger_worker -> start(frame_gray, analysis.passenger_faces, analysis.passenger_landmarks);
+}
+
+// Waits for the passenger fit; a failed fit leaves no passengers
+inline void finishPassengers( Detectors& detectors, FrameAnalysis& analysis )
+{
+    if (!detectors.passenger_worker -> finish())
+    {
+        analysis.passenger_faces.clear();
+        analysis.passenger_landmarks.clear();
+    }
+}
+
+// Detection and landmark fitting on the grayscale frame, which may be buffers.gray.
+// The LBF fit converts color frames to gray itself, so fitting on the gray frame
+// gives the same landmarks without a second conversion.
+inline void analyzeGray( const cv::Mat& frame_gray, Detectors& detectors, StreamState& stream,
+                         AnalysisBuffers& buffers, FrameAnalysis& analysis, FrameTiming& timing )
+{
+    // intermediate frames reuse the last fit, moved by optical flow
+    analysis.face_found = true;
+    analysis.passenger_faces.clear();
+    analysis.passenger_landmarks.clear();
+    bool propagated = propagateLandmarks( stream.landmark_flow, frame_gray, analysis.face, analysis.landmarks );
+    markStage( timing, STAGE_FIT );
+    if (propagated)
+    {
+        return;
+    }
+
+    cv::equalizeHist( frame_gray, buffers.equalized );
+    markStage( timing, STAGE_GRAY );
+
+    std::vector<cv::Rect>& faces = buffers.faces;
+    trackFace( stream.face_tracker, detectors.face_cascade, buffers.equalized, faces );
+    markStage( timing, STAGE_DETECT );
+
+    analysis.face_found = false;
+    if (faces.empty())
+    {
+        stream.landmark_flow.valid = false;
+        return;
+    }
+
+    // faces[0] is the driver; only that face goes through the driver fit
+    analysis.face = faces[0];
+    buffers.driver_face.assign(1, faces[0]);
+    bool passengers = startPassengers( frame_gray, detectors, stream, faces, analysis );
+    bool fitted = detectors.facemark -> fit(frame_gray, buffers.driver_face, buffers.shapes);
+    if (passengers)
+    {
+        finishPassengers( detectors, analysis );
+    }
+    markStage( timing, STAGE_FIT );
+    if (!fitted)
+    {
+        stream.landmark_flow.valid = false;
+        return;
+    }
+
+    analysis.face_found = true;
+    analysis.landmarks.assign(buffers.shapes[0].begin(), buffers.shapes[0].end());
+    resetLandmarkFlow( stream.landmark_flow, frame_gray, faces[0], analysis.landmarks );
+}
+
+// Analysis of a captured frame, BGR or in a raw YUV layout
+inline void analyzeFrame( const cv::Mat& frame, Detectors& detectors, StreamState& stream,
+                          AnalysisBuffers& buffers, FrameAnalysis& analysis, FrameTiming& timing,
+                          YuvLayout layout = YUV_NONE )
+{
+    cv::Mat gray;
+    lumaPlane( frame, layout, buffers.gray, gray );
+    markStage( timing, STAGE_GRAY );
+    analyzeGray( gray, detectors, stream, buffers, analysis, timing );
+}
+
+struct DriverState {
+    bool face_found;
+    float blinking_ratio;
+    float yawning_ratio;
+    bool is_blinking;
+    bool is_yawning;
+};
+
+// driver state from the eye and mouth ratios of a frame, computed one by one or in a RatioBatch
+inline DriverState classifyRatios( bool face_found, float left_eye_ratio, float right_eye_ratio, float mouth_ratio,
+                                   float blinking_threshold = BLINKING_RATIO_THRESHOLD,
+                                   float yawning_threshold = YAWNING_RATIO_THRESHOLD )
+{
+    DriverState state {face_found, 0.0, 0.0, false, false};
+    if (!face_found)
+    {
+        return state;
+    }
+
+    state.blinking_ratio = (left_eye_ratio + right_eye_ratio) / 2;
+    state.yawning_ratio = mouth_ratio;
+    state.is_blinking = state.blinking_ratio > blinking_threshold;
+    state.is_yawning = state.yawning_ratio < yawning_threshold;
+    return state;
+}
+
+inline DriverState classifyLandmarks( const FrameAnalysis& analysis,
+                                     float blinking_threshold = BLINKING_RATIO_THRESHOLD,
+                                     float yawning_threshold = YAWNING_RATIO_THRESHOLD )
+{
+    if (!analysis.face_found)
+    {
+        return classifyRatios( false, 0, 0, 0 );
+    }
+    return classifyRatios( true, blinkingRatio( analysis.landmarks, LEFT_EYE_POINTS ),
+                           blinkingRatio( analysis.landmarks, RIGHT_EYE_POINTS ),
+                           yawningRatio( analysis.landmarks, MOUTH_EDGE_POINTS ),
+                           blinking_threshold, yawning_threshold );
+}
+
+// PIXEL_NV12 frames are height rows of luma followed by height / 2 rows of interleaved
+// chroma with the same stride; PIXEL_YUYV frames have 2 bytes per pixel
+enum PixelFormat { PIXEL_GRAY, PIXEL_BGR, PIXEL_RGB, PIXEL_BGRA, PIXEL_RGBA, PIXEL_NV12, PIXEL_YUYV };
+
+// A frame owned by the caller. The engine only reads the pixels during process().
+struct FrameView {
+    const uchar* data;
+    int width;
+    int height;
+    size_t stride;       // bytes from one row to the next
+    PixelFormat format;
+    double time_ms;      // capture time, which drives the drowsiness windows
+};
+
+// Driver state after one frame
+struct EngineOutput {
+    DriverState state;
+    cv::Rect face;
+    float drowsiness_perc;
+    float yaw_perc;
+    float horizon_drowsiness[N_HORIZONS];
+    float horizon_yaw[N_HORIZONS];
+    bool horizon_complete[N_HORIZONS];  // the window covers the whole horizon yet
+    bool alert;
+    int passengers;      // passenger faces fitted in this frame, in passenger mode
+    int quality_level;   // 0 unless the latency governor has degraded detection and fitting
+};
+
+// One analyzed video stream. Every engine owns its models and state, so independent
+// engines can run side by side, each on its own thread.
+//
+//     DrowsinessEngine engine;
+//     engine.load();
+//     FrameView view = {pixels, width, height, stride, PIXEL_BGR, time_ms};
+//     const EngineOutput& output = engine.process(view);
+class DrowsinessEngine {
+public:
+    bool load( const std::string& cascade_path = FACE_CASCADE_PATH, const std::string& model_path = findLbfModel() )
+    {
+        return loadDetectors(detectors, cascade_path, model_path);
+    }
+
+    // enables passenger mode, fitting the other faces on a second model
+    void loadPassengers( const std::string& model_path = findLbfModel() )
+    {
+        loadPassengerModel(detectors, model_path);
+        stream.passengers = true;
+    }
+
+    // tracking, optical flow, profiling and governor settings, to be changed before the first frame
+    StreamState& settings()
+    {
+        return stream;
+    }
+
+    // landmarks of the last frame where a face was found
+    const std::vector<cv::Point2f>& landmarks() const
+    {
+        return analysis.landmarks;
+    }
+
+    const EngineOutput& process( const FrameView& view )
+    {
+        startTiming(timing);
+
+        // the caller's pixels are wrapped, not copied; only the NV12 luma rows are needed
+        cv::Mat frame(view.height, view.width, pixelType(view.format), const_cast<uchar*>(view.data), view.stride);
+
+        const cv::Mat* gray = &frame;
+        if (view.format != PIXEL_GRAY && view.format != PIXEL_NV12)
+        {
+            cv::cvtColor(frame, buffers.gray, grayConversion(view.format));
+            gray = &buffers.gray;
+        }
+        markStage(timing, STAGE_GRAY);
+
+        analyzeGray(*gray, detectors, stream, buffers, analysis, timing);
+        output.state = classifyLandmarks(analysis);
+        if (output.state.face_found)
+        {
+            // frames without a driver face do not count towards the window
+            updateWindow(stream.window, view.time_ms, output.state.is_blinking, output.state.is_yawning);
+        }
+        markStage(timing, STAGE_CLASSIFY);
+        recordFrame(stream.profile, timing);
+        governLatency(stream.governor, timing, stream.face_tracker, stream.landmark_flow);
+
+        const DriverWindow& window = stream.window;
+        output.face = analysis.face;
+        output.drowsiness_perc = window.drowsiness_perc;
+        output.yaw_perc = window.yaw_perc;
+        for (int h = 0; h < N_HORIZONS; h++)
+        {
+            output.horizon_drowsiness[h] = window.horizon_drowsiness[h];
+            output.horizon_yaw[h] = window.horizon_yaw[h];
+            output.horizon_complete[h] = window.horizon_complete[h];
+        }
+        output.alert = driverAlert(window);
+        output.passengers = (int)analysis.passenger_landmarks.size();
+        output.quality_level = stream.governor.level;
+        return output;
+    }
+
+private:
+    static int pixelType( PixelFormat format )
+    {
+        switch (format)
+        {
+        case PIXEL_GRAY: case PIXEL_NV12: return CV_8UC1;
+        case PIXEL_YUYV: return CV_8UC2;
+        case PIXEL_BGR: case PIXEL_RGB: return CV_8UC3;
+        default: return CV_8UC4;
+        }
+    }
+
+    static int grayConversion( PixelFormat format )
+    {
+        switch (format)
+        {
+        case PIXEL_RGB: return cv::COLOR_RGB2GRAY;
+        case PIXEL_BGRA: return cv::COLOR_BGRA2GRAY;
+        case PIXEL_RGBA: return cv::COLOR_RGBA2GRAY;
+        case PIXEL_YUYV: return cv::COLOR_YUV2GRAY_YUYV;
+        default: return cv::COLOR_BGR2GRAY;
+        }
+    }
+
+    Detectors detectors;
+    StreamState stream;
+    AnalysisBuffers buffers;
+    FrameAnalysis analysis;
+    FrameTiming timing;
+    EngineOutput output;
+};
+
+#endif
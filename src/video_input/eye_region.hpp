@@ -0,0 +1,144 @@
+#ifndef EYE_REGION_HPP
+#define EYE_REGION_HPP
+
+#include "opencv2/imgproc.hpp"
+
+#include <algorithm>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Bounding box of a landmark polygon grown by margin, clamped to the frame
+inline cv::Rect regionBox(const cv::Point* polygon, int n_points, int margin, const cv::Size& frame_size)
+{
+    int min_x = polygon[0].x;
+    int max_x = polygon[0].x;
+    int min_y = polygon[0].y;
+    int max_y = polygon[0].y;
+    for (int i = 1; i < n_points; i++)
+    {
+        min_x = std::min(min_x, polygon[i].x);
+        max_x = std::max(max_x, polygon[i].x);
+        min_y = std::min(min_y, polygon[i].y);
+        max_y = std::max(max_y, polygon[i].y);
+    }
+
+    cv::Rect box(min_x - margin, min_y - margin, max_x - min_x + 2 * margin, max_y - min_y + 2 * margin);
+    return box & cv::Rect(0, 0, frame_size.width, frame_size.height);
+}
+
+// Copies the frame pixels inside the polygon into patch, which covers the polygon's
+// bounding box plus margin; pixels outside the polygon are black. The polygon is
+// rasterized into mask only inside the box, so the cost follows the patch size and
+// not the frame size. mask and patch are reused when they already have the right size.
+inline void isolateRegion(const cv::Mat& frame, const cv::Point* polygon, int n_points, int margin,
+                          cv::Mat& mask, cv::Mat& patch)
+{
+    cv::Rect box = regionBox(polygon, n_points, margin, frame.size());
+    if (box.empty())
+    {
+        patch.release();
+        return;
+    }
+
+    mask.create(box.size(), CV_8UC1);
+    mask.setTo(cv::Scalar::all(0));
+    cv::fillPoly(mask, &polygon, &n_points, 1, cv::Scalar::all(255), cv::LINE_8, 0, -box.tl());
+
+    patch.create(box.size(), frame.type());
+    patch.setTo(cv::Scalar::all(0));
+    frame(box).copyTo(patch, mask);
+}
+
+// Index of the first zero byte of row[0..n), or -1
+inline int firstZero(const uchar* row, int n)
+{
+    int x = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    for (; x + 16 <= n; x += 16)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i*)(row + x));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, zero));
+        if (mask)
+        {
+            return x + __builtin_ctz(mask);
+        }
+    }
+#endif
+    for (; x < n; x++)
+    {
+        if (row[x] == 0)
+        {
+            return x;
+        }
+    }
+    return -1;
+}
+
+// Index of the last zero byte of row[0..n), or -1
+inline int lastZero(const uchar* row, int n)
+{
+    int x = n;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    for (; x >= 16; x -= 16)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i*)(row + x - 16));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, zero));
+        if (mask)
+        {
+            return x - 16 + 31 - __builtin_clz(mask);
+        }
+    }
+#endif
+    for (x--; x >= 0; x--)
+    {
+        if (row[x] == 0)
+        {
+            return x;
+        }
+    }
+    return -1;
+}
+
+// Bounding box of the zero pixels of a CV_8UC1 patch, such as a binarized eye,
+// or an empty rectangle when there are none. Each row is reduced to its first and
+// last zero, 16 pixels at a time where SSE2 is available.
+inline cv::Rect zeroPixelBounds(const cv::Mat& binary)
+{
+    CV_Assert(binary.type() == CV_8UC1);
+
+    int min_x = binary.cols;
+    int max_x = -1;
+    int min_y = -1;
+    int max_y = -1;
+    for (int y = 0; y < binary.rows; y++)
+    {
+        const uchar* row = binary.ptr<uchar>(y);
+        int first = firstZero(row, binary.cols);
+        if (first < 0)
+        {
+            continue;
+        }
+        // the last zero lies at or after the first one
+        int last = first + lastZero(row + first, binary.cols - first);
+
+        min_x = std::min(min_x, first);
+        max_x = std::max(max_x, last);
+        if (min_y < 0)
+        {
+            min_y = y;
+        }
+        max_y = y;
+    }
+
+    if (max_y < 0)
+    {
+        return cv::Rect();
+    }
+    return cv::Rect(min_x, min_y, max_x - min_x + 1, max_y - min_y + 1);
+}
+
+#endif
@@ -0,0 +1,254 @@
+#ifndef FACE_TRACKER_HPP
+#define FACE_TRACKER_HPP
+
+#include "opencv2/objdetect.hpp"
+#include "opencv2/imgproc.hpp"
+
+#include <cmath>
+#include <string>
+#include <vector>
+
+// How the driver is picked among the faces of a full-frame detection: the largest face,
+// the one closest to the frame center, or the one continuing the previous driver face
+// (the largest when there is none nearby)
+enum DriverSelection { DRIVER_LARGEST, DRIVER_CENTRAL, DRIVER_TRACK };
+
+inline DriverSelection parseDriverSelection(const std::string& name)
+{
+    if (name == "largest")
+    {
+        return DRIVER_LARGEST;
+    }
+    if (name == "central")
+    {
+        return DRIVER_CENTRAL;
+    }
+    if (name == "track")
+    {
+        return DRIVER_TRACK;
+    }
+    return DRIVER_LARGEST;
+}
+
+// Face localization that searches around the previous face instead of the full frame.
+// A full-frame detection runs every redetect_interval frames or when the track is lost.
+struct FaceTracker {
+    bool enabled = false;
+    int redetect_interval = 15;      // frames between forced full-frame detections
+    float roi_expand = 0.5;          // search window margin, relative to the face size
+    float size_tolerance = 0.3;      // allowed face size change between frames
+    DriverSelection driver_selection = DRIVER_LARGEST;
+
+    // Full-frame detection on a gray image downscaled by detect_scale, limited to the face
+    // sizes seen so far once size_warmup faces have been found. Faces are reported at full
+    // resolution, so the landmarks are still fitted on the full frame.
+    bool scaled_detection = false;
+    float detect_scale = 1.0;
+    int size_warmup = 10;            // detections before the size range is used
+    float size_rate = 0.05;          // weight of a new face in the running size statistics
+    float size_spread = 3;           // half-width of the range, in mean absolute deviations
+    float size_margin = 0.2;         // extra range, relative to the mean size
+
+    bool has_track = false;
+    cv::Rect last_face;
+    int frames_since_detection = 0;
+
+    int size_samples = 0;
+    float size_mean = 0;             // running face width at full resolution
+    float size_deviation = 0;        // running mean absolute deviation of the width
+    cv::Mat small;                   // downscaled frame, reused between detections
+};
+
+// adds a detected face width to the running size statistics
+inline void learnFaceSize(FaceTracker& tracker, int width)
+{
+    if (tracker.size_samples == 0)
+    {
+        tracker.size_mean = width;
+        tracker.size_deviation = 0;
+    }
+    else
+    {
+        // early samples weigh more, so the statistics settle within the warmup
+        float rate = std::max(tracker.size_rate, 1.0f / (tracker.size_samples + 1));
+        tracker.size_deviation += rate * (std::abs(width - tracker.size_mean) - tracker.size_deviation);
+        tracker.size_mean += rate * (width - tracker.size_mean);
+    }
+    tracker.size_samples++;
+}
+
+// detectMultiScale size limits in the detection image, empty until the warmup is over
+inline void learnedSizeRange(const FaceTracker& tracker, float scale, cv::Size& min_size, cv::Size& max_size)
+{
+    min_size = cv::Size();
+    max_size = cv::Size();
+    if (tracker.size_samples < tracker.size_warmup)
+    {
+        return;
+    }
+    float spread = tracker.size_spread * tracker.size_deviation + tracker.size_margin * tracker.size_mean;
+    int min_width = (int)(std::max(0.0f, tracker.size_mean - spread) * scale);
+    int max_width = (int)std::ceil((tracker.size_mean + spread) * scale);
+    min_size = cv::Size(min_width, min_width);
+    max_size = cv::Size(max_width, max_width);
+}
+
+// cascade detection over the whole frame, downscaled and size-limited when configured
+inline void detectScaled(FaceTracker& tracker, cv::CascadeClassifier& cascade,
+                         const cv::Mat& frame_gray, std::vector<cv::Rect>& faces)
+{
+    float scale = std::min(tracker.detect_scale, 1.0f);
+    if (!tracker.scaled_detection)
+    {
+        cascade.detectMultiScale(frame_gray, faces);
+        return;
+    }
+
+    const cv::Mat* image = &frame_gray;
+    if (scale < 1.0f)
+    {
+        cv::resize(frame_gray, tracker.small, cv::Size(), scale, scale, cv::INTER_AREA);
+        image = &tracker.small;
+    }
+    scale = (float)image->cols / frame_gray.cols;
+
+    cv::Size min_size, max_size;
+    learnedSizeRange(tracker, scale, min_size, max_size);
+    cascade.detectMultiScale(*image, faces, 1.1, 3, 0, min_size, max_size);
+    if (faces.empty() && max_size.width > 0)
+    {
+        // the driver may have moved out of the usual range
+        cascade.detectMultiScale(*image, faces);
+    }
+
+    for (size_t i = 0; i < faces.size(); i++)
+    {
+        cv::Rect& face = faces[i];
+        face = cv::Rect(cvRound(face.x / scale), cvRound(face.y / scale),
+                        cvRound(face.width / scale), cvRound(face.height / scale));
+        face &= cv::Rect(0, 0, frame_gray.cols, frame_gray.rows);
+    }
+}
+
+inline cv::Rect expandRect(const cv::Rect& rect, float factor, const cv::Size& bounds)
+{
+    int dx = (int)(rect.width * factor);
+    int dy = (int)(rect.height * factor);
+    cv::Rect expanded(rect.x - dx, rect.y - dy, rect.width + 2 * dx, rect.height + 2 * dy);
+    return expanded & cv::Rect(0, 0, bounds.width, bounds.height);
+}
+
+// picks the face closest to the previous track, or the first one without a track
+inline size_t closestFace(const std::vector<cv::Rect>& faces, const cv::Rect& last_face)
+{
+    size_t best = 0;
+    double best_distance = -1;
+    cv::Point last_center = (last_face.tl() + last_face.br()) * 0.5;
+
+    for (size_t i = 0; i < faces.size(); i++)
+    {
+        cv::Point center = (faces[i].tl() + faces[i].br()) * 0.5;
+        double distance = cv::norm(center - last_center);
+        if (best_distance < 0 || distance < best_distance)
+        {
+            best_distance = distance;
+            best = i;
+        }
+    }
+    return best;
+}
+
+inline size_t largestFace(const std::vector<cv::Rect>& faces)
+{
+    size_t best = 0;
+    for (size_t i = 1; i < faces.size(); i++)
+    {
+        if (faces[i].area() > faces[best].area())
+        {
+            best = i;
+        }
+    }
+    return best;
+}
+
+// index of the driver face among the detections
+inline size_t selectDriver(const FaceTracker& tracker, const std::vector<cv::Rect>& faces, const cv::Size& frame_size)
+{
+    if (tracker.driver_selection == DRIVER_CENTRAL)
+    {
+        cv::Rect center(frame_size.width / 2, frame_size.height / 2, 0, 0);
+        return closestFace(faces, center);
+    }
+    if (tracker.driver_selection == DRIVER_TRACK && tracker.has_track)
+    {
+        size_t closest = closestFace(faces, tracker.last_face);
+        cv::Point offset = (faces[closest].tl() + faces[closest].br()) * 0.5 -
+                           (tracker.last_face.tl() + tracker.last_face.br()) * 0.5;
+        if (cv::norm(offset) < tracker.last_face.width)
+        {
+            return closest;
+        }
+    }
+    return largestFace(faces);
+}
+
+// Full-frame detection; the driver face, if any, is moved to faces[0]
+inline void detectFullFrame(FaceTracker& tracker, cv::CascadeClassifier& cascade,
+                            const cv::Mat& frame_gray, std::vector<cv::Rect>& faces)
+{
+    detectScaled(tracker, cascade, frame_gray, faces);
+    if (!faces.empty())
+    {
+        std::swap(faces[0], faces[selectDriver(tracker, faces, frame_gray.size())]);
+        if (tracker.scaled_detection)
+        {
+            learnFaceSize(tracker, faces[0].width);
+        }
+    }
+    tracker.frames_since_detection = 0;
+    tracker.has_track = !faces.empty();
+    if (tracker.has_track)
+    {
+        tracker.last_face = faces[0];
+    }
+}
+
+// Fills faces with the detections for this frame. The tracked face, if any, is faces[0].
+inline void trackFace(FaceTracker& tracker, cv::CascadeClassifier& cascade,
+                      const cv::Mat& frame_gray, std::vector<cv::Rect>& faces)
+{
+    faces.clear();
+
+    if (!tracker.enabled || !tracker.has_track || tracker.frames_since_detection >= tracker.redetect_interval)
+    {
+        detectFullFrame(tracker, cascade, frame_gray, faces);
+        return;
+    }
+
+    cv::Rect roi = expandRect(tracker.last_face, tracker.roi_expand, frame_gray.size());
+    cv::Size min_size(tracker.last_face.width * (1 - tracker.size_tolerance),
+                      tracker.last_face.height * (1 - tracker.size_tolerance));
+    cv::Size max_size(tracker.last_face.width * (1 + tracker.size_tolerance),
+                      tracker.last_face.height * (1 + tracker.size_tolerance));
+
+    cascade.detectMultiScale(frame_gray(roi), faces, 1.1, 3, 0, min_size, max_size);
+
+    if (faces.empty())
+    {
+        // track lost, fall back to the full frame
+        detectFullFrame(tracker, cascade, frame_gray, faces);
+        return;
+    }
+
+    for (size_t i = 0; i < faces.size(); i++)
+    {
+        faces[i].x += roi.x;
+        faces[i].y += roi.y;
+    }
+    std::swap(faces[0], faces[closestFace(faces, tracker.last_face)]);
+
+    tracker.last_face = faces[0];
+    tracker.frames_since_detection++;
+}
+
+#endif
@@ -5,9 +5,22 @@
 #include "opencv2/face.hpp"
 #include <opencv2/core/mat.hpp>
 #include <stdio.h>
+#include <stdlib.h>
 #include <math.h>
 
 #include <iostream>
+#include <thread>
+
+#include "face_tracker.hpp"
+#include "landmark_flow.hpp"
+#include "frame_pipeline.hpp"
+#include "state_writer.hpp"
+#include "lbf_model.hpp"
+#include "eye_region.hpp"
+#include "driver_window.hpp"
+#include "iris_threshold.hpp"
+#include "landmark_ratios.hpp"
+#include "stage_profile.hpp"
 
 using namespace std;
 using namespace cv;
@@ -16,285 +29,492 @@ using namespace cv::face;
 CascadeClassifier face_cascade;
 CascadeClassifier eyes_cascade;
 Ptr<Facemark> facemark;
-
-int LEFT_EYE_POINTS[6] = {36, 37, 38, 39, 40, 41};
-int RIGHT_EYE_POINTS[6] = {42, 43, 44, 45, 46, 47};
+FaceTracker face_tracker;
+LandmarkFlow landmark_flow;
+ThresholdCalibration threshold_calibration;
+StageProfile stage_profile;
 
 struct EyeFrameOutput {  
+    bool face_found;
     bool state;     
     Mat eye_frame;
     Mat eye_frame_processed;
+    float iris_fraction;
+    float threshold;
 };
 
-Point middlePoint(Point p1, Point p2) 
-{
-    float x = (float)((p1.x + p2.x) / 2);
-    float y = (float)((p1.y + p2.y) / 2);
-    Point p = Point(x, y);
-    return p;
-}
+// Intermediate images and vectors of a frame. They are kept from one frame to the next,
+// so once the sizes have settled a frame needs no new heap allocation.
+struct FrameBuffers {
+    Mat gray;
+    Mat equalized;
+    vector<Rect> faces;
+    vector<Rect> driver_face;
+    vector<vector<Point2f> > shapes;
+    EyeBuffers eye;
+    Mat small_frame;
+    Mat eye_tile;
+    Mat eye_tile_bin;
+    Mat eye_tile_processed;
+    String text;
+};
 
-// Drowsiness estimation based on landmarks
-float blinkingRatio(vector<Point2f> landmarks, int points[]) 
+// extraction of eye polygon from the image
+void isolate( const Mat& frame, const vector<Point2f>& landmarks, const int points[], Mat& frame_eye )
 {
-    Point left = Point(landmarks[points[0]].x, landmarks[points[0]].y);
-    Point right = Point(landmarks[points[3]].x, landmarks[points[3]].y);
-    Point top = middlePoint(landmarks[points[1]], landmarks[points[2]]);
-    Point bottom = middlePoint(landmarks[points[5]], landmarks[points[4]]);
-
-    float eye_width = hypot((left.x - right.x), (left.y - right.y));
-    float eye_height = hypot((top.x - bottom.x), (top.y - bottom.y));
-    float ratio = eye_width / eye_height;
-    
-    try {
-        float ratio = eye_width / eye_height;
-    } catch (exception& e) {
-        ratio = 0.0;
+    Point region[6];
+
+    for (int i = 0; i < 6; i++) {
+        region[i] = Point(landmarks[points[i]].x, landmarks[points[i]].y-1);
     }
 
-    return ratio;
+    // the mask is scratch space of this thread, the patch buffer belongs to the caller
+    static thread_local Mat mask;
+    isolateRegion(frame, region, 6, 5, mask, frame_eye);
 }
 
-// Drowsiness estimation based on morph. operations and iris extraction
-float iris_size(Mat frame) 
+// detects eyes and displays. The eye images are written into results, reusing their buffers.
+// Frames without a fitted face leave results.face_found false and no eye images.
+void detectFaceEyesAndDisplay( Mat frame, FrameBuffers& buffers, EyeFrameOutput& results, FrameTiming& timing )
 {
-    Size size = frame.size();
-    int height = size.height;
-    int width = size.width;
-
-    Mat frame_resized = frame(Range(5, height-5), Range(5, width-5));
-    int height_resized = height-10;
-    int width_resized = width-10;
-
-    float n_pixels = height_resized * width_resized;
-    float n_blacks = n_pixels - cv::countNonZero(frame_resized);
+    results.face_found = false;
+    results.state = 0;
+    results.iris_fraction = 0;
+    results.threshold = 0;
+
+    cvtColor( frame, buffers.gray, COLOR_BGR2GRAY );
+    markStage( timing, STAGE_GRAY );
+
+    std::vector<Rect>& faces = buffers.faces;
+    vector<vector<Point2f> >& shapes = buffers.shapes;
+    faces.resize(1);
+    shapes.resize(1);
+
+    // intermediate frames reuse the last fit, moved by optical flow
+    bool propagated = propagateLandmarks( landmark_flow, buffers.gray, faces[0], shapes[0] );
+    markStage( timing, STAGE_FIT );
+    if (propagated) {
+        cv::rectangle(frame, faces[0], Scalar(255, 0, 0), 2);
+    } else {
+        equalizeHist( buffers.gray, buffers.equalized );
+        markStage( timing, STAGE_GRAY );
+        trackFace( face_tracker, face_cascade, buffers.equalized, faces );
+        markStage( timing, STAGE_DETECT );
+
+        // faces[0] is the driver; the other faces are not fitted
+        buffers.driver_face.assign(faces.begin(), faces.begin() + min(faces.size(), (size_t)1));
+        bool fitted = facemark -> fit(frame, buffers.driver_face, shapes);
+        markStage( timing, STAGE_FIT );
+        if (fitted) {
+            // facemarks visualization
+            // drawFacemarks(frame, shapes[0], cv::Scalar(0, 0, 255));
+            resetLandmarkFlow( landmark_flow, buffers.gray, faces[0], shapes[0] );
+        } else {
+            // face not found 
+            landmark_flow.valid = false;
+        }
 
-    return (n_blacks / n_pixels);
-}
+        for ( size_t i = 0; i < faces.size(); i++ )
+        {
+            rectangle( frame,  Point(faces[i].x, faces[i].y), Size(faces[i].x + faces[i].width, faces[i].y + faces[i].height), Scalar(255,0,0), 2 );
+        }
 
-Mat iris_correction( Mat frame_eye) {
-    int leftmost = 0;
-    int rightmost = frame_eye.cols;
-    int top = 0;
-    int bottom = frame_eye.rows;
-
-    int hdist;
-    int vdist;
-    double hv_ratio;
-
-    for (int y = 0; y < frame_eye.rows; y++ ) {
-        for (int x = 0; x < frame_eye.cols; x++) {
-            if (frame_eye.at<uchar>(cv::Point2i(x,y)) == 0) {
-                if (x < leftmost) {
-                    leftmost = x;
-                }
-                if (y < top) {
-                    top = y;
-                }
-                if (x > rightmost) {
-                    rightmost = x;
-                }
-                if (y > bottom) {
-                    bottom = y;
-                }
-            }
+        if (!fitted)
+        {
+            // shapes still holds the landmarks of an earlier frame, or nothing at all
+            results.eye_frame.release();
+            results.eye_frame_processed.release();
+            markStage( timing, STAGE_CLASSIFY );
+            return;
         }
+        cv::rectangle(frame, faces[0], Scalar(255, 0, 0), 2);
     }
 
-    hdist = rightmost - leftmost;
-    vdist = bottom - top;
-    hv_ratio = (double)hdist / (double)vdist;
-
-    Mat frame_eye_new;
-    if (hv_ratio > 2.3) {
-        frame_eye_new = cv::Mat(frame_eye.rows, frame_eye.cols, CV_8UC1, Scalar::all(255));
-        cv::threshold(frame_eye_new, frame_eye_new, 240, 255.0, THRESH_BINARY);
-    } else {
-        frame_eye_new = frame_eye;
+    isolate(frame, shapes[0], LEFT_EYE_POINTS, results.eye_frame );
+    if (results.eye_frame.empty())
+    {
+        // a degenerate fit whose eye lies outside the frame counts as no face
+        results.eye_frame_processed.release();
+        markStage( timing, STAGE_CLASSIFY );
+        return;
     }
+    results.face_found = true;
+    float threshold = calibrate_threshold(results.eye_frame, threshold_calibration, buffers.eye);
+    // cout << threshold<< std::endl;
 
-    // cout <<  hv_ratio << std::endl ; // for testing
-    return frame_eye_new;
-}
-
-// Morphological operations used for iris extraction
-Mat eye_processing(Mat frame_eye_resized, float threshold)
-{
-    Mat inv_mask;
-    inRange(frame_eye_resized, Scalar(0, 0, 0), Scalar(0, 0, 0), inv_mask);
-    frame_eye_resized.setTo(Scalar(255, 255, 255), inv_mask);
+    // the calibration left the closed patch of this eye frame in buffers.eye
+    threshold_eye(threshold, buffers.eye).copyTo(results.eye_frame_processed);
 
-    // Contouring eye region
-    Mat frame_eye_contours;
-    cv::bilateralFilter(frame_eye_resized, frame_eye_contours, 10, 20, 5);
+    // imshow("Eye original", results.eye_frame);
+    // imshow("Eye binary", results.eye_frame_processed);
 
-    Mat frame_eye_binary;
-    cvtColor( frame_eye_contours, frame_eye_binary, COLOR_BGR2GRAY );
-    cv::threshold(frame_eye_binary, frame_eye_binary, threshold, 255.0, THRESH_BINARY);
+    results.threshold = threshold;
+    results.iris_fraction = iris_size(results.eye_frame_processed);
+    if (results.iris_fraction < 0.1) {
+        results.state = 1;
+        // cout << "BLINKING" << std::endl;
+    } else {
+        // cout << "normal" << std::endl;
+        results.state = 0;
+    }
+    markStage( timing, STAGE_CLASSIFY );
+    
+    
+    // isolate(frame, shapes[0], RIGHT_EYE_POINTS );
 
-    Mat kernel(5,5, CV_8UC1, Scalar::all(255));
-    Mat frame_eye_dilated;
-    cv::dilate(frame_eye_binary, frame_eye_dilated, kernel);
+    // float blinking_ratio_left = blinkingRatio( shapes[0], LEFT_EYE_POINTS );
+    // float blinking_ratio_right = blinkingRatio( shapes[0], RIGHT_EYE_POINTS );
 
-    Mat frame_eye_closing;
-    cv::erode(frame_eye_dilated, frame_eye_closing, kernel);
+    // float isBlinking = (blinking_ratio_left + blinking_ratio_right) /2;
 
-    Mat frame_eye_polished;
-    frame_eye_polished = iris_correction(frame_eye_closing);
+    // if (isBlinking > 5) 
+    // {
+    //     cout << "BLINKING!" << endl;
+    // }
+    // else 
+    // {
+    //     cout << "not blinking" << endl;
+    // }
 
-    return frame_eye_polished;
+    // cout << "Left: " << (blinking_ratio_left) << endl;    
+    // cout << "Right: " << (blinking_ratio_right) << endl;    
 }
 
-// calibration of threshold values used in binarization
-float find_best_threshold(Mat eye_frame) 
-{
-    map <int, float> trials;
-    float average_iris_size = 0.45;
-
-    for (int i = 5; i < 100; i = i+5) 
-    {
-        // applying different thresholds
-        Mat frame_eye_binary = eye_processing(eye_frame, i); 
-        float iris_result = iris_size(frame_eye_binary);
-        trials.insert ( pair <int, float>(i, iris_result) );
-    }
+// Everything known about one frame as it moves through the processing stages
+struct FramePacket {
+    Mat frame;
+    double time_ms;
+    FrameTiming timing;
+    EyeFrameOutput results;
+    float drowsiness_perc;
+    bool alert;
+    FrameBuffers buffers;
+};
 
-    float closest_distance = 100;
-    float closest_threshold;
-    for (auto it = trials.begin(); it != trials.end(); ++it)
+// Adds the frame to the drowsiness window. Every analyzed frame goes through here,
+// whether it is shown or not.
+void windowStage( FramePacket& packet, DriverWindow& window )
+{
+    if (packet.results.face_found)
     {
-        float distance = abs(average_iris_size - (*it).second);
-        if (distance <= closest_distance) 
-        {
-            closest_distance = distance;
-            closest_threshold = (*it).first;
-        }
+        // frames without a driver face do not count towards the window
+        updateWindow( window, packet.time_ms, packet.results.state, false );
     }
-    
-    return closest_threshold;
+    packet.drowsiness_perc = window.drowsiness_perc;
+    packet.alert = driverAlert(window);
 }
 
-// extraction of eye polygon from the image
-Mat isolate( Mat frame, vector<Point2f> landmarks, int points[])
-{
-    Point region[1][20];
-
-    for (int i = 0; i < 6; i++) {
-        region[0][i] = Point(landmarks[points[i]].x, landmarks[points[i]].y-1);
-    }
-
-    Size size = frame.size();
-    int height = size.height;
-    int width = size.width;
-
-    cv::Mat black_frame = cv::Mat(height, width, CV_8UC1, Scalar::all(0));
-    cv::Mat mask = cv::Mat(height, width, CV_8UC1, Scalar::all(255));
+const String ALERT_TEXT = "ALERT! The driver is sleepy!";
+const String OK_TEXT = "The driver state is OK";
 
-    int npt[] = { 6 };
-    const Point* ppt[1] = { region[0] };
-    cv::fillPoly(mask, ppt, npt, 1, cv::Scalar(0, 0, 0));
-    cv::bitwise_not(mask, mask);
+// Draws the driver state of a packet onto canvas, which the display keeps from one frame
+// to the next, so it is only allocated when the frame size changes
+void renderStage( FramePacket& packet, Mat& canvas )
+{
+    skipTiming( packet.timing );
+    FrameBuffers& buffers = packet.buffers;
 
-    Mat frame_eye;
-    frame.copyTo(frame_eye, mask);
+    // bilinear is enough for a preview and for tiles of a few dozen pixels shown at 100x100
+    Mat& frame = buffers.small_frame;
+    resize(packet.frame, frame, Size(640, 360), 0, 0, INTER_LINEAR);
 
-    cv::Mat white_frame = cv::Mat(height, width, CV_8UC1, Scalar::all(255));
+    if (canvas.rows != frame.rows+130 || canvas.cols != frame.cols+20)
+    {
+        canvas.create(frame.rows+130, frame.cols+20, CV_8UC3);
+        canvas.setTo(Scalar(0, 0, 0));
+    }
+    else
+    {
+        // the borders stay black; only the strip with the tiles and the state text changes
+        canvas.rowRange(frame.rows + 10, canvas.rows).setTo(Scalar(0, 0, 0));
+    }
+    Rect r(10, 10, frame.cols, frame.rows);
+    frame.copyTo(canvas(r));
 
-    int margin = 5;
-    int x_vals[] = {region[0][0].x, region[0][1].x, region[0][2].x, region[0][3].x, region[0][4].x, region[0][5].x};
-    int y_vals[] = {region[0][0].y, region[0][1].y, region[0][2].y, region[0][3].y, region[0][4].y, region[0][5].y};
-    int min_x = *std::min_element(x_vals, x_vals+6) - margin;
-    int max_x = *std::max_element(x_vals, x_vals+6) + margin;
-    int min_y = *std::min_element(y_vals, y_vals+6) - margin;
-    int max_y = *std::max_element(y_vals, y_vals+6) + margin;
+    Rect show_eye(10, frame.rows + 20, 100, 100);
+    Rect show_eye_proc(120, frame.rows + 20, 100, 100);
 
-    Mat frame_eye_resized = frame_eye(Range(min_y, max_y), Range(min_x, max_x));
-    Point origin = Point(min_x, min_y);
+    // the eye tiles stay black while no face is found
+    if (packet.results.face_found)
+    {
+        resize(packet.results.eye_frame, buffers.eye_tile, Size(100, 100), 0, 0, INTER_LINEAR);
+        resize(packet.results.eye_frame_processed, buffers.eye_tile_bin, Size(100, 100), 0, 0, INTER_LINEAR);
+        cvtColor(buffers.eye_tile_bin, buffers.eye_tile_processed, COLOR_GRAY2RGB);
+        buffers.eye_tile.copyTo(canvas(show_eye));
+        buffers.eye_tile_processed.copyTo(canvas(show_eye_proc));
+    }
 
-    return frame_eye_resized;
+    // formatted into a reused string instead of building temporaries
+    char line[64];
+    snprintf(line, sizeof(line), "Drowsiness percentage: %f", packet.drowsiness_perc);
+    buffers.text.assign(line);
+    putText(canvas, buffers.text, Point2f(20, 40), FONT_HERSHEY_DUPLEX, 0.9, Scalar(0, 200, 200), 1);
+        
+    if (packet.alert) 
+    {
+        // cout << "ALERT! The driver is sleepy!" << endl;   
+        putText(canvas, ALERT_TEXT, Point2f(canvas.cols - 400, canvas.rows - 50), FONT_HERSHEY_DUPLEX, 0.9, Scalar(30, 30, 147), 1);  
+    }
+    else 
+    {
+        putText(canvas, OK_TEXT, Point2f(canvas.cols - 400, canvas.rows - 50), FONT_HERSHEY_DUPLEX, 0.9, Scalar(30, 147, 31), 1);  
+    }
+    markStage( packet.timing, STAGE_RENDER );
 }
 
-// detects eyes and displays
-EyeFrameOutput detectFaceEyesAndDisplay( Mat frame )
+// Shows the canvas and handles window events for wait_ms. Returns false when the user asked to quit.
+bool displayStage( FramePacket& packet, const Mat& canvas, int wait_ms )
 {
-    Mat frame_gray;
-    cvtColor( frame, frame_gray, COLOR_BGR2GRAY );
-    equalizeHist( frame_gray, frame_gray );
+    skipTiming( packet.timing );
+    imshow("Driver State", canvas);
 
-    std::vector<Rect> faces;
-    face_cascade.detectMultiScale( frame_gray, faces );
-
-    Mat faceROI = frame( faces[0] );
+    bool quit = waitKey(max(wait_ms, 1)) == 27; // escape
+    markStage( packet.timing, STAGE_DISPLAY );
+    return !quit;
+}
 
-    for ( size_t i = 0; i < faces.size(); i++ )
+// Every frame is analyzed, but only frames at least 1 / display_fps apart are drawn and
+// shown, so the display does not set the analysis rate.
+void runSerial( VideoCapture& capture, double display_fps )
+{
+    DriverWindow window;
+    FramePacket packet;
+    Mat canvas;
+    int64 display_period = (int64)(getTickFrequency() / display_fps);
+    int64 next_display = 0;
+
+    startTiming( packet.timing );
+    while ( capture.read(packet.frame) )
     {
-        rectangle( frame,  Point(faces[i].x, faces[i].y), Size(faces[i].x + faces[i].width, faces[i].y + faces[i].height), Scalar(255,0,0), 2 );
-
-        Mat faceROI_gray = frame_gray( faces[i] );
-        faceROI = frame( faces[i] );
-
-    }
-
-    cv::rectangle(frame, faces[0], Scalar(255, 0, 0), 2);
-    vector<vector<Point2f> > shapes;
+        if( packet.frame.empty() )
+        {
+            cerr << "--(!) No captured frame -- Break!\n";
+            break;
+        }
+        packet.time_ms = frameTimeMs(capture);
+        markStage( packet.timing, STAGE_CAPTURE );
 
-    if (facemark -> fit(frame, faces, shapes)) {
-        // facemarks visualization
-        // drawFacemarks(frame, shapes[0], cv::Scalar(0, 0, 255));
-    } else {
-        // face not found 
+        detectFaceEyesAndDisplay( packet.frame, packet.buffers, packet.results, packet.timing ); // main logic execution
+        windowStage( packet, window );
+        if (getTickCount() >= next_display)
+        {
+            next_display = getTickCount() + display_period;
+            renderStage( packet, canvas );
+            if (!displayStage( packet, canvas, 1 ))
+            {
+                break;
+            }
+        }
+        recordFrame( stage_profile, packet.timing );
+        startTiming( packet.timing );
     }
+}
 
-    Mat eye_frame = isolate(frame, shapes[0], LEFT_EYE_POINTS );
-    float threshold = find_best_threshold(eye_frame);
-    // cout << threshold<< std::endl;
+// Analysis without any GUI call, writing one record per frame
+void runHeadless( VideoCapture& capture, StateWriter& writer )
+{
+    DriverWindow window;
+    Mat frame;
+    FrameBuffers buffers;
+    EyeFrameOutput results;
+    FrameTiming timing;
+    long frame_index = 0;
 
-    Mat eye_frame_processed = eye_processing(eye_frame, threshold);
+    startTiming( timing );
+    while ( capture.read(frame) && !frame.empty() )
+    {
+        double time_ms = frameTimeMs(capture);
+        markStage( timing, STAGE_CAPTURE );
 
-    // imshow("Eye original", eye_frame);
-    // imshow("Eye binary", eye_frame_processed);
+        detectFaceEyesAndDisplay( frame, buffers, results, timing ); // main logic execution
+        if (results.face_found)
+        {
+            updateWindow( window, time_ms, results.state, false );
+        }
 
-    if (iris_size(eye_frame_processed) < 0.1) {
-        return EyeFrameOutput {1, eye_frame, eye_frame_processed};
-        // cout << "BLINKING" << std::endl;
-    } else {
-        // cout << "normal" << std::endl;
-        return EyeFrameOutput {0, eye_frame, eye_frame_processed};
+        writer.begin();
+        writer.field("frame", frame_index);
+        writer.field("timestamp_ms", time_ms);
+        writer.field("face_found", results.face_found);
+        writer.field("iris_fraction", results.iris_fraction);
+        writer.field("threshold", results.threshold);
+        writer.field("blinking", results.state);
+        writer.field("drowsiness_perc", window.drowsiness_perc);
+        for (int h = 0; h < N_HORIZONS; h++)
+        {
+            if (window.horizon_complete[h])
+            {
+                writer.field(BLINK_HORIZON_FIELDS[h], window.horizon_drowsiness[h]);
+            }
+            else
+            {
+                writer.emptyField(BLINK_HORIZON_FIELDS[h]);
+            }
+        }
+        writer.field("alert", driverAlert(window));
+        writer.end();
+        frame_index++;
+        recordFrame( stage_profile, timing );
+        startTiming( timing );
     }
-    
-    
-    // isolate(frame, shapes[0], RIGHT_EYE_POINTS );
-
-    // float blinking_ratio_left = blinkingRatio( shapes[0], LEFT_EYE_POINTS );
-    // float blinking_ratio_right = blinkingRatio( shapes[0], RIGHT_EYE_POINTS );
+    writer.flush();
+}
 
-    // float isBlinking = (blinking_ratio_left + blinking_ratio_right) /2;
+// Capture and eye analysis each run on their own thread, connected by a bounded ring.
+// Analyzed frames go to a single slot that the main thread, as highgui requires, renders
+// and shows at up to display_fps; frames that arrive in between replace each other there
+// and are never drawn, so the analysis never waits for the display.
+void runPipeline( VideoCapture& capture, double display_fps )
+{
+    const size_t queue_size = 4;
+    SpscRing<FramePacket> captured(queue_size);
+    LatestSlot<FramePacket> latest;
+    // packets handed back by the slot go back to capture with their buffers, so frames are not reallocated
+    SpscRing<FramePacket> recycled(2 * queue_size + 4);
+    DriverWindow window;
+
+    thread capture_thread([&]() {
+        while (true)
+        {
+            FramePacket packet;
+            recycled.tryPop(packet);
+            startTiming( packet.timing );
+            if ( !capture.read(packet.frame) || packet.frame.empty() )
+            {
+                break;
+            }
+            packet.time_ms = frameTimeMs(capture);
+            markStage( packet.timing, STAGE_CAPTURE );
+            if (!captured.push(std::move(packet)))
+            {
+                break;
+            }
+        }
+        captured.close();
+    });
 
-    // if (isBlinking > 5) 
-    // {
-    //     cout << "BLINKING!" << endl;
-    // }
-    // else 
-    // {
-    //     cout << "not blinking" << endl;
-    // }
+    // the analysis stages of every frame are recorded here, before the display may drop it
+    thread analyze_thread([&]() {
+        FramePacket packet;
+        while (captured.pop(packet))
+        {
+            skipTiming( packet.timing );
+            detectFaceEyesAndDisplay( packet.frame, packet.buffers, packet.results, packet.timing ); // main logic execution
+            windowStage( packet, window );
+            recordFrame( stage_profile, packet.timing );
+            if (!latest.publish(packet))
+            {
+                break;
+            }
+            recycled.tryPush(std::move(packet));
+        }
+        captured.close();
+        latest.close();
+    });
+
+    const double display_period_ms = 1000.0 / display_fps;
+    // Rendering and display only see the frames that are shown, so they are recorded in a
+    // profile of their own, with the display period as its budget.
+    StageProfile display_profile;
+    display_profile.enabled = stage_profile.enabled;
+    display_profile.budget_ms = display_period_ms;
+    display_profile.name = "display";
+    FramePacket packet;
+    Mat canvas;
+    while (latest.take(packet))
+    {
+        startTiming( packet.timing );
+        int64 start = getTickCount();
+        renderStage( packet, canvas );
+        // waiting for events fills the rest of the display period
+        double spent_ms = (getTickCount() - start) * 1000.0 / getTickFrequency();
+        if (!displayStage( packet, canvas, (int)(display_period_ms - spent_ms) ))
+        {
+            break;
+        }
+        recordFrame( display_profile, packet.timing );
+    }
+    latest.close();
 
-    // cout << "Left: " << (blinking_ratio_left) << endl;    
-    // cout << "Right: " << (blinking_ratio_right) << endl;    
+    analyze_thread.join();
+    capture_thread.join();
 }
 
 int main( int argc, const char** argv )
 {
+    bool use_pipeline = false;
+    double display_fps = 30;
+    bool headless = false;
+    String output_path;
+    String output_format = "jsonl";
+    for (int i = 1; i < argc; i++)
+    {
+        String arg = argv[i];
+        if (arg == "--track")
+        {
+            face_tracker.enabled = true;
+        }
+        else if (arg == "--redetect" && i + 1 < argc)
+        {
+            face_tracker.redetect_interval = atoi(argv[++i]);
+        }
+        else if (arg == "--driver" && i + 1 < argc)
+        {
+            face_tracker.driver_selection = parseDriverSelection(argv[++i]);
+        }
+        else if (arg == "--detect-scale" && i + 1 < argc)
+        {
+            face_tracker.scaled_detection = true;
+            face_tracker.detect_scale = atof(argv[++i]);
+        }
+        else if (arg == "--headless")
+        {
+            headless = true;
+        }
+        else if (arg == "--output" && i + 1 < argc)
+        {
+            output_path = argv[++i];
+        }
+        else if (arg == "--format" && i + 1 < argc)
+        {
+            output_format = argv[++i];
+        }
+        else if (arg == "--pipeline")
+        {
+            use_pipeline = true;
+        }
+        else if (arg == "--display-fps" && i + 1 < argc)
+        {
+            display_fps = max(1.0, atof(argv[++i]));
+        }
+        else if (arg == "--flow" && i + 1 < argc)
+        {
+            landmark_flow.enabled = true;
+            landmark_flow.keyframe_interval = atoi(argv[++i]);
+        }
+        else if (arg == "--profile")
+        {
+            stage_profile.enabled = true;
+        }
+        else if (arg == "--budget" && i + 1 < argc)
+        {
+            stage_profile.budget_ms = atof(argv[++i]);
+        }
+        else if (arg == "--calibrate")
+        {
+            threshold_calibration.enabled = true;
+        }
+    }
 
     String face_cascade_name = samples::findFile("../haarcascades/haarcascade_frontalface_alt.xml" );
-    String facemark_filename = "../models/lbfmodel.yaml";
+    String facemark_filename = findLbfModel();
     facemark = createFacemarkLBF();
     facemark -> loadModel(facemark_filename);
-    cout << "Loaded facemark LBF model" << endl;
+    cerr << "Loaded facemark LBF model" << endl;
 
     if( !face_cascade.load( face_cascade_name ) )
     {
-        cout << "--(!)Error loading face cascade\n";
+        cerr << "--(!)Error loading face cascade\n";
         return -1;
     };
 
@@ -316,85 +536,34 @@ int main( int argc, const char** argv )
     
     if ( ! capture.read(frames))
     {
-        cout << "--(!)Error opening video capture\n";
+        cerr << "--(!)Error opening video capture\n";
         return -1;
     }
 
-    Mat frame;
-    int frame_counter = 0;
-    int blink_counter = 0;
-    while ( capture.read(frame) )
+    if (!output_path.empty() && !headless)
     {
-        if( frame.empty() )
-        {
-            cout << "--(!) No captured frame -- Break!\n";
-            break;
-        }
-
-        EyeFrameOutput results = detectFaceEyesAndDisplay( frame ); // main logic execution
-        bool is_blinking = results.state;
-
-        Mat eye_frame;
-        Mat eye_frame_processed_bin;
-        Mat eye_frame_processed;
-
-        resize(frame, frame, Size(640, 360), 0, 0, INTER_CUBIC);
-
-        resize(results.eye_frame, eye_frame, Size(100, 100), 0, 0, INTER_CUBIC);
-        resize(results.eye_frame_processed, eye_frame_processed_bin, Size(100, 100), 0, 0, INTER_CUBIC);
-        cvtColor(eye_frame_processed_bin, eye_frame_processed, COLOR_GRAY2RGB);
-
-        Mat canvas(frame.rows+130, frame.cols+20, CV_8UC3, Scalar(0, 0, 0));
-        Rect r(10, 10, frame.cols, frame.rows);
-        frame.copyTo(canvas(r));
-
-        Rect show_eye(10, frame.rows + 20, 100, 100);
-        Rect show_eye_proc(120, frame.rows + 20, 100, 100);
-
-        eye_frame.copyTo(canvas(show_eye));
-        eye_frame_processed.copyTo(canvas(show_eye_proc));
-
-        frame_counter++;
-        if (is_blinking)
-        {
-            blink_counter++;
-        };
-
-        float drowsiness_perc;
-        if (frame_counter == 20) 
-        {
-            drowsiness_perc = (float)blink_counter / frame_counter;
-            frame_counter = 0;
-            blink_counter = 0;
-            // cout << "Drowsiness percentage: " << (drowsiness_perc) << endl; 
-            // cout << "Yawing percentage: " << (yaw_perc) << endl;    
-        }
-
-        if (!drowsiness_perc)
-        {
-            drowsiness_perc = 0.0;
-        }
-
-        putText(canvas, "Drowsiness percentage: " + to_string(drowsiness_perc), Point2f(20, 40), FONT_HERSHEY_DUPLEX, 0.9, Scalar(0, 200, 200), 1);
-            
-        if (drowsiness_perc > 0.8) 
-        {
-            // cout << "ALERT! The driver is sleepy!" << endl;   
-            putText(canvas, "ALERT! The driver is sleepy!", Point2f(canvas.cols - 400, canvas.rows - 50), FONT_HERSHEY_DUPLEX, 0.9, Scalar(30, 30, 147), 1);  
-        }
-        else 
-        {
-            putText(canvas, "The driver state is OK", Point2f(canvas.cols - 400, canvas.rows - 50), FONT_HERSHEY_DUPLEX, 0.9, Scalar(30, 147, 31), 1);  
-        }
-        
-        
-        imshow("Driver State", canvas);
-        
+        // the windowed modes only draw the driver state, they write no records
+        cerr << "--(!)Error: --output needs --headless\n";
+        return -1;
+    }
 
-        if( waitKey(10) == 27 )
+    if (headless)
+    {
+        StateWriter writer;
+        if (!writer.open( output_path.empty() ? "-" : output_path, output_format ))
         {
-            break; // escape
+            cerr << "--(!)Error opening output " << output_path << " as " << output_format << "\n";
+            return -1;
         }
+        runHeadless( capture, writer );
+    }
+    else if (use_pipeline)
+    {
+        runPipeline( capture, display_fps );
+    }
+    else
+    {
+        runSerial( capture, display_fps );
     }
     return 0;
 }
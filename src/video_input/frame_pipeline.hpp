@@ -0,0 +1,194 @@
+#ifndef FRAME_PIPELINE_HPP
+#define FRAME_PIPELINE_HPP
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Bounded single-producer/single-consumer ring buffer. Items are moved in and out,
+// so frames travel between stages without copying pixel data.
+// Either side may close the ring: the producer to signal the end of the stream,
+// the consumer to make the producer stop.
+template <typename T>
+class SpscRing {
+public:
+    explicit SpscRing(size_t capacity) : slots(capacity + 1), head(0), tail(0), closed(false) {}
+
+    // blocks while the ring is full, returns false once it is closed
+    bool push(T&& item)
+    {
+        size_t current = tail.load(std::memory_order_relaxed);
+        size_t next = (current + 1) % slots.size();
+        for (int spins = 0; next == head.load(std::memory_order_acquire); spins++)
+        {
+            if (closed.load(std::memory_order_acquire))
+            {
+                return false;
+            }
+            backoff(spins);
+        }
+        if (closed.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+
+        slots[current] = std::move(item);
+        tail.store(next, std::memory_order_release);
+        return true;
+    }
+
+    // blocks while the ring is empty, returns false once it is closed and drained
+    bool pop(T& item)
+    {
+        size_t current = head.load(std::memory_order_relaxed);
+        for (int spins = 0; current == tail.load(std::memory_order_acquire); spins++)
+        {
+            if (closed.load(std::memory_order_acquire) && current == tail.load(std::memory_order_acquire))
+            {
+                return false;
+            }
+            backoff(spins);
+        }
+
+        item = std::move(slots[current]);
+        head.store((current + 1) % slots.size(), std::memory_order_release);
+        return true;
+    }
+
+    // non-blocking variants, return false instead of waiting
+    bool tryPush(T&& item)
+    {
+        size_t current = tail.load(std::memory_order_relaxed);
+        size_t next = (current + 1) % slots.size();
+        if (next == head.load(std::memory_order_acquire) || closed.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+        slots[current] = std::move(item);
+        tail.store(next, std::memory_order_release);
+        return true;
+    }
+
+    bool tryPop(T& item)
+    {
+        size_t current = head.load(std::memory_order_relaxed);
+        if (current == tail.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+        item = std::move(slots[current]);
+        head.store((current + 1) % slots.size(), std::memory_order_release);
+        return true;
+    }
+
+    void close()
+    {
+        closed.store(true, std::memory_order_release);
+    }
+
+    bool isClosed() const
+    {
+        return closed.load(std::memory_order_acquire);
+    }
+
+private:
+    // spin briefly, then sleep so idle stages leave the cores to the busy ones
+    static void backoff(int spins)
+    {
+        if (spins < 64)
+        {
+            std::this_thread::yield();
+        }
+        else
+        {
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+    }
+
+    std::vector<T> slots;
+    std::atomic<size_t> head;
+    std::atomic<size_t> tail;
+    std::atomic<bool> closed;
+};
+
+// Single slot holding the newest item, for a consumer that only wants the latest one,
+// such as a display running at its own rate. The producer never waits: publishing swaps
+// the item with the slot's content, which is an item the consumer has already taken or
+// one it never got to, and either can be reused by the producer.
+template <typename T>
+class LatestSlot {
+public:
+    LatestSlot() : fresh(false), closed(false) {}
+
+    // returns false once the slot is closed
+    bool publish(T& item)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (closed)
+            {
+                return false;
+            }
+            std::swap(slot, item);
+            fresh = true;
+        }
+        changed.notify_one();
+        return true;
+    }
+
+    // Waits for an item newer than the last one taken and swaps it into item.
+    // Returns false once the slot is closed and holds nothing new.
+    bool take(T& item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this]() { return fresh || closed; });
+        if (!fresh)
+        {
+            return false;
+        }
+        std::swap(slot, item);
+        fresh = false;
+        return true;
+    }
+
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+        }
+        changed.notify_all();
+    }
+
+private:
+    T slot;
+    bool fresh;
+    bool closed;
+    std::mutex mutex;
+    std::condition_variable changed;
+};
+
+// Runs process on every item of input on its own thread and forwards it to output.
+// process returns false to end the stream; both rings are closed when the stage ends.
+template <typename T, typename Process>
+std::thread startStage(SpscRing<T>& input, SpscRing<T>& output, Process process)
+{
+    return std::thread([&input, &output, process]() mutable {
+        T item;
+        while (input.pop(item))
+        {
+            if (!process(item) || !output.push(std::move(item)))
+            {
+                break;
+            }
+        }
+        input.close();
+        output.close();
+    });
+}
+
+#endif
@@ -5,338 +5,1063 @@
 #include "opencv2/face.hpp"
 #include <opencv2/core/mat.hpp>
 #include <stdio.h>
+#include <stdlib.h>
 #include <math.h>
 #include <tuple>
 
 #include <iostream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <limits>
+
+#include "frame_pipeline.hpp"
+#include "state_writer.hpp"
+#include "eye_region.hpp"
+#include "drowsiness_engine.hpp"
+#include "landmark_trace.hpp"
 
 using namespace std;
 using namespace cv;
 using namespace cv::face;
 
-CascadeClassifier face_cascade;
 CascadeClassifier eyes_cascade;
-Ptr<Facemark> facemark;
-
-int LEFT_EYE_POINTS[6] = {36, 37, 38, 39, 40, 41};
-int RIGHT_EYE_POINTS[6] = {42, 43, 44, 45, 46, 47};
-int MOUTH_INNER[2] = {62, 66};
-int MOUTH_EDGE_POINTS[6] = {48, 50, 52, 54, 56, 58};
 
 struct StateOutput {       
     bool state;
     Mat frame;
+    float ratio;
 };
 
-Point middlePoint(Point p1, Point p2) 
+void isolate( const Mat& frame, YuvLayout layout, const vector<Point2f>& landmarks, const int points[],
+              Mat& frame_region )
 {
-    float x = (float)((p1.x + p2.x) / 2);
-    float y = (float)((p1.y + p2.y) / 2);
-    Point p = Point(x, y);
-    return p;
+    Point region[6];
+
+    for (int i = 0; i < 6; i++) {
+        region[i] = Point(landmarks[points[i]].x, landmarks[points[i]].y);
+    }
+
+    // the mask is scratch space of this thread, the patch buffer belongs to the caller
+    static thread_local Mat mask;
+    if (layout != YUV_NONE)
+    {
+        // raw frames: only the box around the region is converted to BGR
+        static thread_local Mat roi;
+        isolateYuvRegion(frame, layout, region, 6, 5, mask, roi, frame_region);
+        return;
+    }
+    isolateRegion(frame, region, 6, 5, mask, frame_region);
 }
 
-float blinkingRatio (vector<Point2f> landmarks, int points[]) 
+// Intermediate images and vectors of a frame. They are kept from one frame to the next,
+// so once the sizes have settled a frame needs no new heap allocation.
+struct FrameBuffers : AnalysisBuffers {
+    Mat eye_tile;
+    Mat mouth_tile;
+    String text;
+};
+
+// the eye patch is written into blink.frame, reusing its buffer
+void isBlinking( const Mat& frame, YuvLayout layout, const FrameAnalysis& analysis, StateOutput& blink )
 {
+    blink.state = 0;
+    blink.ratio = 0.0;
+    if (!analysis.face_found)
+    {
+        blink.frame.release();
+        return;
+    }
 
-    Point left = Point(landmarks[points[0]].x, landmarks[points[0]].y);
-    Point right = Point(landmarks[points[3]].x, landmarks[points[3]].y);
-    Point top = middlePoint(landmarks[points[1]], landmarks[points[2]]);
-    Point bottom = middlePoint(landmarks[points[5]], landmarks[points[4]]);
+    isolate(frame, layout, analysis.landmarks, LEFT_EYE_POINTS, blink.frame);
+    // isolate(frame, analysis.landmarks, RIGHT_EYE_POINTS );
+    float blinking_ratio_left = blinkingRatio( analysis.landmarks, LEFT_EYE_POINTS );
+    float blinking_ratio_right = blinkingRatio( analysis.landmarks, RIGHT_EYE_POINTS );
 
-    float eye_width = hypot((left.x - right.x), (left.y - right.y));
-    float eye_height = hypot((top.x - bottom.x), (top.y - bottom.y));
-    float ratio = eye_width / eye_height;
-    
-    try {
-        float ratio = eye_width / eye_height;
-    } catch (exception& e) {
-        ratio = 0.0;
-    }
+    float avg_blinking_ratio = (blinking_ratio_left + blinking_ratio_right) /2;
+    // cout << "BLinking ratio: " << avg_blinking_ratio << endl;
 
-    return ratio;
+    blink.ratio = avg_blinking_ratio;
+    if (avg_blinking_ratio > BLINKING_RATIO_THRESHOLD) 
+    {
+        // cout << "BLINKING!" << endl;
+        blink.state = 1;
+    }
 }
 
-float yawningRatio (vector<Point2f> landmarks, int points[])
+
+// the mouth patch is written into yaw.frame, reusing its buffer
+void isYawning( const Mat& frame, YuvLayout layout, const FrameAnalysis& analysis, StateOutput& yaw )
 {
-    Point left = Point(landmarks[points[0]].x, landmarks[points[0]].y);
-    Point right = Point(landmarks[points[3]].x, landmarks[points[3]].y);
-    Point top = middlePoint(landmarks[points[1]], landmarks[points[2]]);
-    Point bottom = middlePoint(landmarks[points[5]], landmarks[points[4]]);
-
-    float eye_width = hypot((left.x - right.x), (left.y - right.y));
-    float eye_height = hypot((top.x - bottom.x), (top.y - bottom.y));
-    float ratio = eye_width / eye_height;
-    
-    try {
-        float ratio = eye_width / eye_height;
-    } catch (exception& e) {
-        ratio = 0.0;
-    }
-
-    return ratio;
+    yaw.state = 0;
+    yaw.ratio = 0.0;
+    if (!analysis.face_found)
+    {
+        yaw.frame.release();
+        return;
+    }
+
+    isolate(frame, layout, analysis.landmarks, MOUTH_EDGE_POINTS, yaw.frame);
+    float yawning_ratio = yawningRatio( analysis.landmarks, MOUTH_EDGE_POINTS );
+    // cout << "Yawning ratio: " << yawning_ratio << endl;
+
+    yaw.ratio = yawning_ratio;
+    if (yawning_ratio < YAWNING_RATIO_THRESHOLD) 
+    {
+        // cout << "YAWNING!" << endl;
+        yaw.state = 1;
+    }
 }
 
-Mat isolate( Mat frame, vector<Point2f> landmarks, int points[], String part)
+// Ratios and flags of one frame, without the eye and mouth tiles used for display
+// One output record per frame, with the window percentages over every horizon
+// In passenger mode the number of fitted passenger faces is added.
+void writeDriverState( StateWriter& writer, const String& stream_name, long frame_index, double timestamp_ms,
+                       const DriverState& state, const DriverWindow& window, int passengers = -1 )
 {
-    Point region[1][20];
-
-    for (int i = 0; i < 6; i++) {
-        region[0][i] = Point(landmarks[points[i]].x, landmarks[points[i]].y);
+    writer.begin();
+    writer.field("stream", stream_name);
+    writer.field("frame", frame_index);
+    writer.field("timestamp_ms", timestamp_ms);
+    writer.field("face_found", state.face_found);
+    writer.field("blinking_ratio", state.blinking_ratio);
+    writer.field("yawning_ratio", state.yawning_ratio);
+    writer.field("blinking", state.is_blinking);
+    writer.field("yawning", state.is_yawning);
+    writer.field("drowsiness_perc", window.drowsiness_perc);
+    writer.field("yaw_perc", window.yaw_perc);
+    for (int h = 0; h < N_HORIZONS; h++)
+    {
+        // horizons longer than the frames seen so far are left out
+        if (window.horizon_complete[h])
+        {
+            writer.field(BLINK_HORIZON_FIELDS[h], window.horizon_drowsiness[h]);
+            writer.field(YAW_HORIZON_FIELDS[h], window.horizon_yaw[h]);
+        }
+        else
+        {
+            writer.emptyField(BLINK_HORIZON_FIELDS[h]);
+            writer.emptyField(YAW_HORIZON_FIELDS[h]);
+        }
     }
+    writer.field("alert", driverAlert(window));
+    if (passengers >= 0)
+    {
+        writer.field("passengers", passengers);
+    }
+    writer.end();
+}
+
+// Everything known about one frame as it moves through the processing stages
+struct FramePacket {
+    Mat frame;
+    YuvLayout layout;   // of frame, YUV_NONE for BGR
+    double time_ms;
+    FrameTiming timing;
+    FrameAnalysis analysis;
+    StateOutput blink;
+    StateOutput yaw;
+    float drowsiness_perc;
+    float yaw_perc;
+    bool alert;
+    FrameBuffers buffers;
+};
+
+void detectStage( FramePacket& packet, Detectors& detectors, StreamState& stream )
+{
+    // detection and landmark fitting run once and are shared by both classifiers
+    skipTiming( packet.timing );
+    analyzeFrame( packet.frame, detectors, stream, packet.buffers, packet.analysis, packet.timing, packet.layout );
+}
 
-    Size size = frame.size();
-    int height = size.height;
-    int width = size.width;
+void classifyStage( FramePacket& packet, DriverWindow& window )
+{
+    skipTiming( packet.timing );
+    isBlinking( packet.frame, packet.layout, packet.analysis, packet.blink );
+    isYawning( packet.frame, packet.layout, packet.analysis, packet.yaw );
 
-    cv::Mat black_frame = cv::Mat(height, width, CV_8UC1, Scalar::all(0));
-    cv::Mat mask = cv::Mat(height, width, CV_8UC1, Scalar::all(255));
+    // raw frames get their face box when they are drawn onto the canvas
+    if (packet.analysis.face_found && packet.layout == YUV_NONE)
+    {
+        cv::rectangle(packet.frame, packet.analysis.face, Scalar(255, 0, 0), 2);
+        for (size_t i = 0; i < packet.analysis.passenger_faces.size(); i++)
+        {
+            cv::rectangle(packet.frame, packet.analysis.passenger_faces[i], Scalar(0, 160, 0), 1);
+        }
+    }
 
-    int npt[] = { 6 };
-    const Point* ppt[1] = { region[0] };
-    cv::fillPoly(mask, ppt, npt, 1, cv::Scalar(0, 0, 0), 0);
-    cv::bitwise_not(mask, mask);
+    if (packet.analysis.face_found)
+    {
+        // frames without a driver face, as when the head turns, do not count towards the window
+        updateWindow( window, packet.time_ms, packet.blink.state, packet.yaw.state );
+    }
+    packet.drowsiness_perc = window.drowsiness_perc;
+    packet.yaw_perc = window.yaw_perc;
+    packet.alert = driverAlert(window);
+    markStage( packet.timing, STAGE_CLASSIFY );
+}
 
-    Mat frame_region;
-    frame.copyTo(frame_region, mask);
+const String ALERT_TEXT = "ALERT! The driver is sleepy!";
+const String OK_TEXT = "The driver state is OK";
 
-    int margin = 5;
-    int x_vals[] = {region[0][0].x, region[0][1].x, region[0][2].x, region[0][3].x, region[0][4].x, region[0][5].x};
-    int y_vals[] = {region[0][0].y, region[0][1].y, region[0][2].y, region[0][3].y, region[0][4].y, region[0][5].y};
-    int min_x = *std::min_element(x_vals, x_vals+6) - margin;
-    int max_x = *std::max_element(x_vals, x_vals+6) + margin;
-    int min_y = *std::min_element(y_vals, y_vals+6) - margin;
-    int max_y = *std::max_element(y_vals, y_vals+6) + margin;
+// Draws the driver state of a packet onto canvas, which the display keeps from one frame
+// to the next, so it is only allocated when the frame size changes
+void renderStage( FramePacket& packet, Mat& canvas )
+{
+    // Driver state window visualization
+    const Mat& frame = packet.frame;
+    FrameBuffers& buffers = packet.buffers;
+    skipTiming( packet.timing );
 
-    Mat frame_region_resized = frame_region(Range(min_y, max_y), Range(min_x, max_x));
-    Point origin = Point(min_x, min_y);
+    Size size = yuvFrameSize(frame, packet.layout);
+    if (canvas.rows != size.height+130 || canvas.cols != size.width+20)
+    {
+        canvas.create(size.height+130, size.width+20, CV_8UC3);
+        canvas.setTo(Scalar(0, 0, 0));
+    }
+    else
+    {
+        // the borders stay black; only the strip with the tiles and the state text changes
+        canvas.rowRange(size.height + 10, canvas.rows).setTo(Scalar(0, 0, 0));
+    }
+    Rect r(10, 10, size.width, size.height);
+    if (packet.layout == YUV_NONE)
+    {
+        frame.copyTo(canvas(r));
+    }
+    else
+    {
+        // the one full-frame color conversion of a raw frame, written straight into the canvas
+        Mat view = canvas(r);
+        cvtColor(frame, view, packet.layout == YUV_NV12 ? COLOR_YUV2BGR_NV12 : COLOR_YUV2BGR_YUYV);
+        if (packet.analysis.face_found)
+        {
+            cv::rectangle(canvas, packet.analysis.face + r.tl(), Scalar(255, 0, 0), 2);
+            for (size_t i = 0; i < packet.analysis.passenger_faces.size(); i++)
+            {
+                cv::rectangle(canvas, packet.analysis.passenger_faces[i] + r.tl(), Scalar(0, 160, 0), 1);
+            }
+        }
+    }
 
-    Size new_size = frame_region_resized.size();
-    int new_height = new_size.height;
-    int new_width = new_size.width;
-    int center[] = {new_width / 2, new_height / 2};
+    Rect show_eye(10, size.height + 20, 100, 100);
+    Rect show_mouth(120, size.height + 20, 100, 100);
 
-    // imshow(part, frame_region_resized);
+    // the tiles stay black while no face is found, as the eye and mouth patches are empty then
+    if (!packet.blink.frame.empty() && !packet.yaw.frame.empty())
+    {
+        // bilinear is enough for tiles of a few dozen pixels shown at 100x100
+        resize(packet.blink.frame, buffers.eye_tile, Size(100, 100), 0, 0, INTER_LINEAR);
+        resize(packet.yaw.frame, buffers.mouth_tile, Size(100, 100), 0, 0, INTER_LINEAR);
+        buffers.eye_tile.copyTo(canvas(show_eye));
+        buffers.mouth_tile.copyTo(canvas(show_mouth));
+    }
 
-    return frame_region_resized;
+    // formatted into a reused string instead of building temporaries
+    char line[64];
+    snprintf(line, sizeof(line), "Drowsiness percentage: %f", packet.drowsiness_perc);
+    buffers.text.assign(line);
+    putText(canvas, buffers.text, Point2f(20, 40), FONT_HERSHEY_DUPLEX, 0.9, Scalar(0, 200, 200), 1);
+    snprintf(line, sizeof(line), "Yawing percentage: %f", packet.yaw_perc);
+    buffers.text.assign(line);
+    putText(canvas, buffers.text, Point2f(20, 75), FONT_HERSHEY_DUPLEX, 0.9, Scalar(0, 200, 200), 1);
+        
+    if (packet.alert) 
+    {
+        // cout << "ALERT! The driver is sleepy!" << endl;   
+        putText(canvas, ALERT_TEXT, Point2f(canvas.cols - 400, canvas.rows - 50), FONT_HERSHEY_DUPLEX, 0.9, Scalar(30, 30, 147), 1);  
+    }
+    else 
+    {
+        putText(canvas, OK_TEXT, Point2f(canvas.cols - 400, canvas.rows - 50), FONT_HERSHEY_DUPLEX, 0.9, Scalar(30, 147, 31), 1);  
+    }
+    markStage( packet.timing, STAGE_RENDER );
 }
 
-StateOutput isBlinking( Mat frame )
+// Shows the canvas and handles window events for wait_ms. Returns false when the user asked to quit.
+bool displayStage( FramePacket& packet, const Mat& canvas, int wait_ms )
 {
-    Mat frame_gray;
-    cvtColor( frame, frame_gray, COLOR_BGR2GRAY );
-    equalizeHist( frame_gray, frame_gray );
-
-    std::vector<Rect> faces;
-    face_cascade.detectMultiScale( frame_gray, faces );
-    int faces_size = faces.size();
+    skipTiming( packet.timing );
+    imshow("Driver State", canvas);
 
-    if (faces_size > 0) {
+    // imshow("Face", frame);
 
+    bool quit = waitKey(max(wait_ms, 1)) == 27; // escape
+    markStage( packet.timing, STAGE_DISPLAY );
+    return !quit;
+}
 
-        Mat faceROI = frame( faces[0] );
+// Every frame is analyzed, but only frames at least 1 / display_fps apart are drawn and
+// shown, so the display does not set the analysis rate.
+void runSerial( VideoCapture& capture, Detectors& detectors, StreamState& stream, double display_fps )
+{
+    FramePacket packet;
+    Mat canvas;
+    int64 display_period = (int64)(getTickFrequency() / display_fps);
+    int64 next_display = 0;
 
-        for ( size_t i = 0; i < faces.size(); i++ )
+    startTiming( packet.timing );
+    while ( capture.read(packet.frame) )
+    {
+        if( packet.frame.empty() )
         {
-            // rectangle( frame,  Point(faces[i].x, faces[i].y), Size(faces[i].x + faces[i].width, faces[i].y + faces[i].height), Scalar(255,0,0), 2 );
+            cerr << "--(!) No captured frame -- Break!\n";
+            break;
+        };
+        if (!frameLayout(packet.frame, stream.yuv, packet.layout))
+        {
+            cerr << "--(!)" << unsupportedFrame(packet.frame) << " -- Break!\n";
+            break;
+        }
+        packet.time_ms = frameTimeMs(capture);
+        markStage( packet.timing, STAGE_CAPTURE );
 
-            Mat faceROI_gray = frame_gray( faces[i] );
-            faceROI = frame( faces[i] );
+        detectStage( packet, detectors, stream );
+        classifyStage( packet, stream.window );
+        if (getTickCount() >= next_display)
+        {
+            next_display = getTickCount() + display_period;
+            renderStage( packet, canvas );
+            if (!displayStage( packet, canvas, 1 ))
+            {
+                break;
+            }
         }
+        recordFrame( stream.profile, packet.timing );
+        governLatency( stream.governor, packet.timing, stream.face_tracker, stream.landmark_flow );
+        skipFrames( stream.governor, capture );
+        startTiming( packet.timing );
+    }
+}
 
-        cv::rectangle(frame, faces[0], Scalar(255, 0, 0), 2);
-        vector<vector<Point2f> > shapes;
+// Analysis without any GUI call. Frames without a face are reported and skipped
+// instead of ending the run, so whole recordings can be processed unattended.
+// With an open trace, the face and landmarks of every frame are also recorded.
+void runHeadless( VideoCapture& capture, Detectors& detectors, StreamState& stream,
+                  StateWriter& writer, const String& stream_name, TraceWriter& trace )
+{
+    Mat frame;
+    FrameBuffers buffers;
+    FrameAnalysis analysis;
+    FrameTiming timing;
+    long frame_index = 0;
 
-        if (facemark -> fit(frame, faces, shapes)) {
-            Mat resized_frame = isolate(frame, shapes[0], LEFT_EYE_POINTS, "eye");
-            // isolate(frame, shapes[0], RIGHT_EYE_POINTS );
-            float blinking_ratio_left = blinkingRatio( shapes[0], LEFT_EYE_POINTS );
-            float blinking_ratio_right = blinkingRatio( shapes[0], RIGHT_EYE_POINTS );
+    startTiming( timing );
+    while ( capture.read(frame) && !frame.empty() )
+    {
+        YuvLayout layout;
+        if (!frameLayout(frame, stream.yuv, layout))
+        {
+            cerr << "--(!)" << unsupportedFrame(frame) << " -- Break!\n";
+            break;
+        }
+        double time_ms = frameTimeMs(capture);
+        markStage( timing, STAGE_CAPTURE );
 
-            float avg_blinking_ratio = (blinking_ratio_left + blinking_ratio_right) /2;
-            // cout << "BLinking ratio: " << avg_blinking_ratio << endl;
+        analyzeFrame( frame, detectors, stream, buffers, analysis, timing, layout );
+        DriverState state = classifyLandmarks( analysis );
 
-            if (avg_blinking_ratio > 3.8) 
-            {
-                // cout << "BLINKING!" << endl;
-                return StateOutput {1, resized_frame};
-            }
-            else 
-            {
-                // cout << "not blinking" << endl;
-                return StateOutput {0, resized_frame};
-            } 
+        if (state.face_found)
+        {
+            updateWindow( stream.window, time_ms, state.is_blinking, state.is_yawning );
+        }
+        markStage( timing, STAGE_CLASSIFY );
+        writeDriverState( writer, stream_name, frame_index, time_ms, state, stream.window,
+                          stream.passengers ? (int)analysis.passenger_landmarks.size() : -1 );
+        if (trace.isOpen())
+        {
+            trace.append( time_ms, analysis.face_found, analysis.face, analysis.landmarks,
+                          stream.passengers ? (int)analysis.passenger_landmarks.size() : -1 );
         }
+        recordFrame( stream.profile, timing );
+        governLatency( stream.governor, timing, stream.face_tracker, stream.landmark_flow );
+        skipFrames( stream.governor, capture );
+        startTiming( timing );
+        frame_index++;
+    }
+    writer.flush();
+    if (trace.isOpen())
+    {
+        trace.flush();
     }
 }
 
-
-StateOutput isYawning( Mat frame )
+// Classification and windows straight from a recorded trace, with the given thresholds.
+// The records are those of the headless run that wrote the trace, when the thresholds
+// are the same.
+int runReplay( const String& trace_path, float blinking_threshold, float yawning_threshold, StateWriter& writer )
 {
-    Mat frame_gray;
-    cvtColor( frame, frame_gray, COLOR_BGR2GRAY );
-    equalizeHist( frame_gray, frame_gray );
+    TraceReader trace;
+    if (!trace.open( trace_path ))
+    {
+        cerr << "--(!)Error reading landmark trace " << trace_path << "\n";
+        return -1;
+    }
 
-    std::vector<Rect> faces;
-    face_cascade.detectMultiScale( frame_gray, faces );
-    int faces_size = faces.size();
+    // the ratios of the whole trace in one batch, as the threshold search computes them
+    size_t n = trace.frames();
+    RatioBatch batch;
+    resizeBatch(batch, (int)n);
+    for (size_t i = 0; i < n; i++)
+    {
+        setBatchItem(batch, (int)i, trace.record(i).points);
+    }
+    computeBatchRatios(batch);
 
-    if (faces_size > 0)
+    // records carry the stream and passenger count of the run that wrote the trace
+    String stream_name = trace.streamName();
+    DriverWindow window;
+    for (size_t i = 0; i < n; i++)
     {
-        Mat faceROI = frame( faces[0] );
+        const TraceRecord& record = trace.record(i);
+        DriverState state = classifyRatios( record.face_found != 0, batch.left_eye[i], batch.right_eye[i],
+                                            batch.mouth[i], blinking_threshold, yawning_threshold );
 
-        for ( size_t i = 0; i < faces.size(); i++ )
+        if (state.face_found)
         {
-            // rectangle( frame,  Point(faces[i].x, faces[i].y), Size(faces[i].x + faces[i].width, faces[i].y + faces[i].height), Scalar(255,0,0), 2 );
+            updateWindow( window, record.time_ms, state.is_blinking, state.is_yawning );
+        }
+        writeDriverState( writer, stream_name, (long)i, record.time_ms, state, window, record.passengers );
+    }
+    writer.flush();
+    return 0;
+}
 
-            Mat faceROI_gray = frame_gray( faces[i] );
-            faceROI = frame( faces[i] );
+// Per-frame result of one range of a recording in chunked mode
+struct ChunkFrame {
+    double time_ms;
+    DriverState state;
+    int passengers;      // -1 outside passenger mode
+};
+
+struct VideoChunk {
+    long first_frame;
+    long end_frame;
+    vector<ChunkFrame> frames;
+    bool complete = false;
+};
+
+// Decodes and analyzes the frames [first_frame, end_frame) of a recording
+bool analyzeChunk( const String& input, Detectors& detectors, const StreamState& settings, VideoChunk& chunk )
+{
+    VideoCapture capture(input);
+    if ( !capture.isOpened() )
+    {
+        return false;
+    }
+    capture.set(CAP_PROP_POS_FRAMES, chunk.first_frame);
+    // backends that land before the requested frame are moved forward by decoding
+    for (long position = (long)capture.get(CAP_PROP_POS_FRAMES); position < chunk.first_frame; position++)
+    {
+        if (!capture.grab())
+        {
+            return false;
         }
- 
-        // cv::rectangle(frame, faces[0], Scalar(255, 0, 0), 2);
-        vector<vector<Point2f> > shapes;
+    }
+    if ((long)capture.get(CAP_PROP_POS_FRAMES) != chunk.first_frame)
+    {
+        return false;
+    }
 
-        if (facemark -> fit(frame, faces, shapes)) {
-            Mat resized_frame = isolate(frame, shapes[0], MOUTH_EDGE_POINTS, "mouth");
-            float yawning_ratio = yawningRatio( shapes[0], MOUTH_EDGE_POINTS );
-            // cout << "Yawning ratio: " << yawning_ratio << endl;
+    // every chunk starts from fresh state, which only gives the sequential results
+    // because chunked mode runs without any state carried between frames
+    StreamState stream = settings;
+    Mat frame;
+    FrameBuffers buffers;
+    FrameAnalysis analysis;
+    FrameTiming timing;
+    chunk.frames.clear();
+    for (long n = chunk.first_frame; n < chunk.end_frame && capture.read(frame) && !frame.empty(); n++)
+    {
+        ChunkFrame result;
+        result.time_ms = frameTimeMs(capture);
+        startTiming( timing );
+        analyzeFrame( frame, detectors, stream, buffers, analysis, timing );
+        result.state = classifyLandmarks( analysis );
+        result.passengers = stream.passengers ? (int)analysis.passenger_landmarks.size() : -1;
+        chunk.frames.push_back(result);
+    }
+    return true;
+}
 
-            if (yawning_ratio < 1.7) 
+// Offline mode for one long recording. The video is split into frame ranges that are
+// decoded and analyzed on all workers, then the windows run over the per-frame results
+// in order, so every record equals the one of a sequential headless run.
+int runChunked( const String& input, StreamState settings, int n_workers, StateWriter& writer )
+{
+    VideoCapture probe(input);
+    long n_frames = probe.isOpened() ? (long)probe.get(CAP_PROP_FRAME_COUNT) : 0;
+    if (n_frames <= 0)
+    {
+        cerr << "--(!)Chunked mode needs a recording with a known frame count: " << input << "\n";
+        return -1;
+    }
+    probe.release();
+
+    if (settings.face_tracker.enabled || settings.face_tracker.scaled_detection ||
+        settings.face_tracker.driver_selection == DRIVER_TRACK ||
+        settings.landmark_flow.enabled || settings.governor.enabled)
+    {
+        cerr << "Chunked mode ignores --track, --detect-scale, --driver track, --flow and --governor, "
+                "whose state would differ at the range boundaries" << endl;
+    }
+    DriverSelection driver_selection = settings.face_tracker.driver_selection;
+    settings.face_tracker = FaceTracker();
+    if (driver_selection != DRIVER_TRACK)
+    {
+        settings.face_tracker.driver_selection = driver_selection;
+    }
+    settings.landmark_flow = LandmarkFlow();
+    settings.governor = LatencyGovernor();
+    settings.profile.enabled = false;
+
+    // a few ranges per worker, so one slow range does not hold up the end of the run
+    const long min_chunk_frames = 300;
+    long chunk_frames = max(min_chunk_frames, n_frames / (4L * n_workers) + 1);
+    vector<VideoChunk> chunks;
+    for (long first = 0; first < n_frames; first += chunk_frames)
+    {
+        VideoChunk chunk;
+        chunk.first_frame = first;
+        // the frame count is only an estimate for some containers, so the last range reads to the end
+        chunk.end_frame = first + chunk_frames < n_frames ? first + chunk_frames : numeric_limits<long>::max();
+        chunks.push_back(chunk);
+    }
+
+    cv::setNumThreads(1);
+    atomic<size_t> next_chunk(0);
+    vector<thread> workers;
+    for (int w = 0; w < n_workers; w++)
+    {
+        workers.push_back(thread([&]() {
+            Detectors detectors;
+            if (!loadDetectors( detectors ))
+            {
+                return;
+            }
+            // passengers are fitted on the faces of each frame alone, so they split like the driver
+            if (settings.passengers)
             {
-                // cout << "YAWNING!" << endl;
-                return StateOutput {1, resized_frame};
+                loadPassengerModel( detectors );
             }
-            else 
+            for (size_t c = next_chunk++; c < chunks.size(); c = next_chunk++)
             {
-                // cout << "not yawning" << endl;
-                return StateOutput {0, resized_frame};
-            } 
-        } else {
+                chunks[c].complete = analyzeChunk( input, detectors, settings, chunks[c] );
+            }
+        }));
+    }
+    for (size_t w = 0; w < workers.size(); w++)
+    {
+        workers[w].join();
+    }
 
+    DriverWindow window;
+    long frame_index = 0;
+    for (size_t c = 0; c < chunks.size(); c++)
+    {
+        const VideoChunk& chunk = chunks[c];
+        if (!chunk.complete)
+        {
+            cerr << "--(!)Error analyzing the range from frame " << chunk.first_frame << " of " << input << "\n";
+            return -1;
+        }
+        for (size_t i = 0; i < chunk.frames.size(); i++)
+        {
+            const ChunkFrame& result = chunk.frames[i];
+            if (result.state.face_found)
+            {
+                updateWindow( window, result.time_ms, result.state.is_blinking, result.state.is_yawning );
+            }
+            writeDriverState( writer, input, frame_index, result.time_ms, result.state, window, result.passengers );
+            frame_index++;
+        }
+        // a short range means the recording ended early, as a sequential run would stop there
+        if (chunk.frames.size() < (size_t)(chunk.end_frame - chunk.first_frame))
+        {
+            break;
         }
     }
-    
+    writer.flush();
+    cerr << input << ": " << frame_index << " frames in " << chunks.size() << " ranges" << endl;
+    return 0;
 }
 
-int main( int argc, const char** argv )
+// Capture, detection and classification each run on their own thread, connected by
+// bounded rings. Classified frames go to a single slot that the main thread, as highgui
+// requires, renders and shows at up to display_fps; frames that arrive in between replace
+// each other there and are never drawn, so the analysis never waits for the display.
+void runPipeline( VideoCapture& capture, Detectors& detectors, StreamState& stream, double display_fps )
 {
+    const size_t queue_size = 4;
+    SpscRing<FramePacket> captured(queue_size);
+    SpscRing<FramePacket> detected(queue_size);
+    LatestSlot<FramePacket> latest;
+    // packets handed back by the slot go back to capture with their buffers, so frames are not reallocated
+    SpscRing<FramePacket> recycled(4 * queue_size + 4);
+
+    // a live camera under the governor drops frames the analysis cannot take yet,
+    // instead of letting them wait in the rings
+    bool drop_frames = stream.governor.enabled && capture.get(CAP_PROP_FRAME_COUNT) <= 0;
+
+    thread capture_thread([&]() {
+        while (true)
+        {
+            FramePacket packet;
+            recycled.tryPop(packet);
+            startTiming( packet.timing );
+            if ( !capture.read(packet.frame) || packet.frame.empty() )
+            {
+                break;
+            }
+            if (!frameLayout(packet.frame, stream.yuv, packet.layout))
+            {
+                cerr << "--(!)" << unsupportedFrame(packet.frame) << " -- Break!\n";
+                break;
+            }
+            packet.time_ms = frameTimeMs(capture);
+            markStage( packet.timing, STAGE_CAPTURE );
+            if (drop_frames)
+            {
+                if (!captured.tryPush(std::move(packet)) && captured.isClosed())
+                {
+                    break;
+                }
+                continue;
+            }
+            if (!captured.push(std::move(packet)))
+            {
+                break;
+            }
+        }
+        captured.close();
+    });
+
+    // the governor watches the analysis stage, which bounds the throughput of the pipeline;
+    // it runs on the detection thread, the only one using the tracker and flow settings
+    thread detect_thread = startStage(captured, detected, [&](FramePacket& packet) {
+        detectStage( packet, detectors, stream );
+        governLatency( stream.governor, packet.timing, stream.face_tracker, stream.landmark_flow );
+        return true;
+    });
+    // the analysis stages of every frame are recorded here, before the display may drop it
+    thread classify_thread([&]() {
+        FramePacket packet;
+        while (detected.pop(packet))
+        {
+            classifyStage( packet, stream.window );
+            recordFrame( stream.profile, packet.timing );
+            if (!latest.publish(packet))
+            {
+                break;
+            }
+            recycled.tryPush(std::move(packet));
+        }
+        detected.close();
+        latest.close();
+    });
+
+    const double display_period_ms = 1000.0 / display_fps;
+    // Rendering and display only see the frames that are shown, on this thread, so they
+    // are recorded in a profile of their own. The display stage includes the wait for
+    // events, so a shown frame is over budget when it takes longer than the display period.
+    StageProfile display_profile;
+    display_profile.enabled = stream.profile.enabled;
+    display_profile.budget_ms = display_period_ms;
+    display_profile.name = stream.profile.name.empty() ? "display" : stream.profile.name + " display";
+    FramePacket packet;
+    Mat canvas;
+    while (latest.take(packet))
+    {
+        startTiming( packet.timing );
+        int64 start = getTickCount();
+        renderStage( packet, canvas );
+        // waiting for events fills the rest of the display period
+        double spent_ms = (getTickCount() - start) * 1000.0 / getTickFrequency();
+        if (!displayStage( packet, canvas, (int)(display_period_ms - spent_ms) ))
+        {
+            break;
+        }
+        recordFrame( display_profile, packet.timing );
+    }
+    latest.close();
 
-    String face_cascade_name = samples::findFile("../haarcascades/haarcascade_frontalface_alt.xml" );
-    String facemark_filename = "../models/lbfmodel.yaml";
+    classify_thread.join();
+    detect_thread.join();
+    capture_thread.join();
+}
 
-    facemark = createFacemarkLBF();
-    facemark -> loadModel(facemark_filename);
-    cout << "Loaded facemark LBF model" << endl;
+// One input of the multi-stream mode
+struct StreamJob {
+    String name;
+    VideoCapture capture;
+    StreamState state;
+    Mat frame;
+    FrameBuffers buffers;
+    FrameAnalysis analysis;
+    FrameTiming timing;
+    long frames = 0;
+    bool alert = false;
+};
 
-    if( !face_cascade.load( face_cascade_name ) )
+bool openCapture( VideoCapture& capture, const String& input, YuvLayout yuv )
+{
+    // inputs made of digits only are camera device indices
+    if (!input.empty() && input.find_first_not_of("0123456789") == String::npos)
     {
-        cout << "--(!)Error loading face cascade\n";
-        return -1;
-    };
+        if (!capture.open(atoi(input.c_str())))
+        {
+            return false;
+        }
+        requestYuv(capture, yuv);
+        return true;
+    }
+    return capture.open(input);
+}
 
-    VideoCapture capture("../sample_videos/CROPPED.MOV");
-    if ( ! capture.isOpened() )
+// Reads and analyzes the next frame of a stream. Returns false at the end of the stream.
+bool processStreamFrame( StreamJob& job, Detectors& detectors, StateWriter& writer, mutex& output_mutex )
+{
+    startTiming( job.timing );
+    skipFrames( job.state.governor, job.capture );
+    if ( !job.capture.read(job.frame) || job.frame.empty() )
     {
-        cout << "--(!)Error opening video capture\n";
-        return -1;
+        lock_guard<mutex> lock(output_mutex);
+        cerr << job.name << ": finished after " << job.frames << " frames" << endl;
+        return false;
     }
+    YuvLayout layout;
+    if (!frameLayout(job.frame, job.state.yuv, layout))
+    {
+        lock_guard<mutex> lock(output_mutex);
+        cerr << "--(!)" << job.name << ": " << unsupportedFrame(job.frame) << "\n";
+        return false;
+    }
+    job.frames++;
+    double time_ms = frameTimeMs(job.capture);
+    markStage( job.timing, STAGE_CAPTURE );
 
-    Mat frame;
-    int frame_counter = 0;
-    int yaw_counter = 0;
-    int blink_counter = 0;
+    analyzeFrame( job.frame, detectors, job.state, job.buffers, job.analysis, job.timing, layout );
+    DriverState state = classifyLandmarks( job.analysis );
 
-    while ( capture.read(frame) )
+    DriverWindow& window = job.state.window;
+    if (state.face_found)
     {
-        if( frame.empty() )
-        {
-            cout << "--(!) No captured frame -- Break!\n";
-            break;
-        };
+        // frames without a driver face do not count towards the window
+        updateWindow( window, time_ms, state.is_blinking, state.is_yawning );
+    }
+    markStage( job.timing, STAGE_CLASSIFY );
+    if (job.state.profile.enabled)
+    {
+        // reports of all streams share stderr
+        lock_guard<mutex> lock(output_mutex);
+        recordFrame( job.state.profile, job.timing );
+    }
+    if (job.state.governor.enabled)
+    {
+        lock_guard<mutex> lock(output_mutex);
+        governLatency( job.state.governor, job.timing, job.state.face_tracker, job.state.landmark_flow );
+    }
 
-        StateOutput blink = isBlinking( frame );
-        StateOutput yaw = isYawning( frame );
-        bool is_blinking = blink.state;
-        bool is_yawning = yaw.state;
-        // Mat eye_frame = blink.frame;
-        // Mat mouth_frame = yaw.frame;
+    bool alert_changed = driverAlert(window) != job.alert;
+    job.alert = driverAlert(window);
+    if (writer.isOpen())
+    {
+        lock_guard<mutex> lock(output_mutex);
+        writeDriverState( writer, job.name, job.frames - 1, time_ms, state, window,
+                          job.state.passengers ? (int)job.analysis.passenger_landmarks.size() : -1 );
+    }
+    else if (alert_changed)
+    {
+        // the console only reports the moments the driver state changes
+        lock_guard<mutex> lock(output_mutex);
+        cout << job.name << ": frame " << job.frames
+             << " drowsiness " << window.drowsiness_perc
+             << " yawning " << window.yaw_perc << endl;
+        cout << job.name << (job.alert ? ": ALERT! The driver is sleepy!" : ": The driver state is OK") << endl;
+    }
+    return true;
+}
 
-        if( blink.frame.empty() || yaw.frame.empty() )
+// Analyzes many inputs on a shared pool of workers. Every worker owns one set of
+// detectors and takes one frame of a waiting stream at a time, so each stream keeps
+// its frame order and state while all workers stay busy.
+int runStreams( const vector<String>& inputs, const StreamState& settings, int n_workers, StateWriter& writer )
+{
+    vector<unique_ptr<StreamJob> > jobs;
+    deque<size_t> ready;
+    for (size_t i = 0; i < inputs.size(); i++)
+    {
+        unique_ptr<StreamJob> job(new StreamJob());
+        job->name = inputs[i];
+        job->state = settings;
+        job->state.profile.name = inputs[i];
+        job->state.governor.name = inputs[i];
+        if ( !openCapture(job->capture, inputs[i], settings.yuv) )
         {
-            cout << "--(!) No captured eye or mouth frame -- Break!\n";
-            break;
-        };
+            cerr << "--(!)Error opening video capture " << inputs[i] << "\n";
+            continue;
+        }
+        ready.push_back(jobs.size());
+        jobs.push_back(std::move(job));
+    }
 
-        // Driver state window visualization
-        Mat eye_frame;
-        Mat mouth_frame;
+    // parallelism comes from the workers, nested OpenCV threads would only oversubscribe
+    cv::setNumThreads(1);
 
-        resize(blink.frame, eye_frame, Size(100, 100), 0, 0, INTER_CUBIC);
-        resize(yaw.frame, mouth_frame, Size(100, 100), 0, 0, INTER_CUBIC);
+    mutex queue_mutex;
+    mutex output_mutex;
+    condition_variable queue_changed;
+    size_t active = jobs.size();
+    bool failed = false;
 
-        Mat canvas(frame.rows+130, frame.cols+20, CV_8UC3, Scalar(0, 0, 0));
-        Rect r(10, 10, frame.cols, frame.rows);
-        frame.copyTo(canvas(r));
+    vector<thread> workers;
+    for (int w = 0; w < n_workers; w++)
+    {
+        workers.push_back(thread([&]() {
+            Detectors detectors;
+            if (!loadDetectors( detectors ))
+            {
+                lock_guard<mutex> lock(queue_mutex);
+                failed = true;
+                return;
+            }
+            if (settings.passengers)
+            {
+                loadPassengerModel( detectors );
+            }
 
-        Rect show_eye(10, frame.rows + 20, 100, 100);
-        Rect show_mouth(120, frame.rows + 20, 100, 100);
+            while (true)
+            {
+                size_t id;
+                {
+                    unique_lock<mutex> lock(queue_mutex);
+                    queue_changed.wait(lock, [&]() { return !ready.empty() || active == 0; });
+                    if (ready.empty())
+                    {
+                        return;
+                    }
+                    id = ready.front();
+                    ready.pop_front();
+                }
+
+                bool more = processStreamFrame( *jobs[id], detectors, writer, output_mutex );
+
+                {
+                    lock_guard<mutex> lock(queue_mutex);
+                    if (more)
+                    {
+                        ready.push_back(id);
+                    }
+                    else
+                    {
+                        active--;
+                    }
+                }
+                queue_changed.notify_all();
+            }
+        }));
+    }
 
-        eye_frame.copyTo(canvas(show_eye));
-        mouth_frame.copyTo(canvas(show_mouth));
+    for (size_t w = 0; w < workers.size(); w++)
+    {
+        workers[w].join();
+    }
+    writer.flush();
+    return failed ? -1 : 0;
+}
 
-        frame_counter++;
-        if (is_blinking)
+int main( int argc, const char** argv )
+{
+    bool use_pipeline = false;
+    double display_fps = 30;
+    bool use_streams = false;
+    bool headless = false;
+    bool chunked = false;
+    String trace_path;
+    String replay_path;
+    float blinking_threshold = BLINKING_RATIO_THRESHOLD;
+    float yawning_threshold = YAWNING_RATIO_THRESHOLD;
+    String output_path;
+    String output_format = "jsonl";
+    int n_workers = thread::hardware_concurrency();
+    StreamState settings;
+    vector<String> inputs;
+
+    for (int i = 1; i < argc; i++)
+    {
+        String arg = argv[i];
+        if (arg == "--track")
         {
-            blink_counter++;
-        };
-
-        if (is_yawning)
+            settings.face_tracker.enabled = true;
+        }
+        else if (arg == "--redetect" && i + 1 < argc)
         {
-            yaw_counter++;
+            settings.face_tracker.redetect_interval = atoi(argv[++i]);
         }
-
-        float drowsiness_perc;
-        float yaw_perc;
-        if (frame_counter == 20) 
+        else if (arg == "--driver" && i + 1 < argc)
         {
-            drowsiness_perc = (float)blink_counter / frame_counter;
-            yaw_perc = (float)yaw_counter / frame_counter;
-            frame_counter = 0;
-            blink_counter = 0;
-            yaw_counter = 0;
-            // cout << "Drowsiness percentage: " << (drowsiness_perc) << endl; 
-            // cout << "Yawing percentage: " << (yaw_perc) << endl;    
+            settings.face_tracker.driver_selection = parseDriverSelection(argv[++i]);
         }
-
-        if (!drowsiness_perc)
+        else if (arg == "--passengers")
         {
-            drowsiness_perc = 0.0;
-            yaw_perc = 0.0;
+            settings.passengers = true;
         }
-
-        putText(canvas, "Drowsiness percentage: " + to_string(drowsiness_perc), Point2f(20, 40), FONT_HERSHEY_DUPLEX, 0.9, Scalar(0, 200, 200), 1);
-        putText(canvas, "Yawing percentage: " + to_string(yaw_perc), Point2f(20, 75), FONT_HERSHEY_DUPLEX, 0.9, Scalar(0, 200, 200), 1);
-            
-        if (drowsiness_perc > 0.8) 
+        else if (arg == "--detect-scale" && i + 1 < argc)
         {
-            // cout << "ALERT! The driver is sleepy!" << endl;   
-            putText(canvas, "ALERT! The driver is sleepy!", Point2f(canvas.cols - 400, canvas.rows - 50), FONT_HERSHEY_DUPLEX, 0.9, Scalar(30, 30, 147), 1);  
+            settings.face_tracker.scaled_detection = true;
+            settings.face_tracker.detect_scale = atof(argv[++i]);
         }
-        else 
+        else if (arg == "--pipeline")
         {
-            putText(canvas, "The driver state is OK", Point2f(canvas.cols - 400, canvas.rows - 50), FONT_HERSHEY_DUPLEX, 0.9, Scalar(30, 147, 31), 1);  
+            use_pipeline = true;
         }
-        
-        
-        imshow("Driver State", canvas);
+        else if (arg == "--display-fps" && i + 1 < argc)
+        {
+            display_fps = max(1.0, atof(argv[++i]));
+        }
+        else if (arg == "--flow" && i + 1 < argc)
+        {
+            settings.landmark_flow.enabled = true;
+            settings.landmark_flow.keyframe_interval = atoi(argv[++i]);
+        }
+        else if (arg == "--profile")
+        {
+            settings.profile.enabled = true;
+        }
+        else if (arg == "--budget" && i + 1 < argc)
+        {
+            settings.profile.budget_ms = atof(argv[++i]);
+            settings.governor.budget_ms = settings.profile.budget_ms;
+        }
+        else if (arg == "--yuv" && i + 1 < argc)
+        {
+            settings.yuv = parseYuvLayout(argv[++i]);
+        }
+        else if (arg == "--governor")
+        {
+            settings.governor.enabled = true;
+        }
+        else if (arg == "--streams")
+        {
+            use_streams = true;
+        }
+        else if (arg == "--headless")
+        {
+            headless = true;
+        }
+        else if (arg == "--chunked")
+        {
+            chunked = true;
+        }
+        else if (arg == "--record-trace" && i + 1 < argc)
+        {
+            trace_path = argv[++i];
+            headless = true;
+        }
+        else if (arg == "--replay" && i + 1 < argc)
+        {
+            replay_path = argv[++i];
+        }
+        else if (arg == "--blink-threshold" && i + 1 < argc)
+        {
+            blinking_threshold = atof(argv[++i]);
+        }
+        else if (arg == "--yawn-threshold" && i + 1 < argc)
+        {
+            yawning_threshold = atof(argv[++i]);
+        }
+        else if (arg == "--output" && i + 1 < argc)
+        {
+            output_path = argv[++i];
+        }
+        else if (arg == "--format" && i + 1 < argc)
+        {
+            output_format = argv[++i];
+        }
+        else if (arg == "--workers" && i + 1 < argc)
+        {
+            n_workers = atoi(argv[++i]);
+        }
+        else
+        {
+            inputs.push_back(arg);
+        }
+    }
+
+    if (inputs.empty())
+    {
+        inputs.push_back("../sample_videos/CROPPED.MOV");
+    }
+
+    // the windowed modes only draw the driver state, they write no records
+    bool writes_records = headless || chunked || use_streams || !replay_path.empty();
+    if (!output_path.empty() && !writes_records)
+    {
+        cerr << "--(!)Error: --output needs --headless, --chunked, --streams or --replay\n";
+        return -1;
+    }
+
+    StateWriter writer;
+    if ((headless || chunked || !replay_path.empty()) && output_path.empty())
+    {
+        output_path = "-";
+    }
+    if (!output_path.empty() && !writer.open( output_path, output_format ))
+    {
+        cerr << "--(!)Error opening output " << output_path << " as " << output_format << "\n";
+        return -1;
+    }
+
+    if (!replay_path.empty())
+    {
+        return runReplay( replay_path, blinking_threshold, yawning_threshold, writer );
+    }
+    if (chunked)
+    {
+        return runChunked( inputs[0], settings, max(n_workers, 1), writer );
+    }
+    if (use_streams)
+    {
+        return runStreams( inputs, settings, max(n_workers, 1), writer );
+    }
+
+    Detectors detectors;
+    if (!loadDetectors( detectors ))
+    {
+        return -1;
+    }
+    if (settings.passengers)
+    {
+        loadPassengerModel( detectors );
+    }
 
-        // imshow("Face", frame);
+    VideoCapture capture;
+    if ( !openCapture(capture, inputs[0], settings.yuv) )
+    {
+        cerr << "--(!)Error opening video capture\n";
+        return -1;
+    }
 
-        if( waitKey(10) == 27 )
+    if (headless)
+    {
+        TraceWriter trace;
+        if (!trace_path.empty() && !trace.open( trace_path, inputs[0] ))
         {
-            break; // escape
+            cerr << "--(!)Error opening landmark trace " << trace_path << "\n";
+            return -1;
         }
+        runHeadless( capture, detectors, settings, writer, inputs[0], trace );
+    }
+    else if (use_pipeline)
+    {
+        runPipeline( capture, detectors, settings, display_fps );
+    }
+    else
+    {
+        runSerial( capture, detectors, settings, display_fps );
     }
     return 0;
 }
-
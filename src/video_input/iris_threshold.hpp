@@ -0,0 +1,289 @@
+#ifndef IRIS_THRESHOLD_HPP
+#define IRIS_THRESHOLD_HPP
+
+#include "opencv2/imgproc.hpp"
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <vector>
+
+#include "eye_region.hpp"
+
+// Iris extraction of the contour method: the eye patch is binarized with the threshold
+// that makes the dark (iris) part closest to its average size.
+
+// Scratch images of the iris extraction, reused by every threshold trial
+struct EyeBuffers {
+    cv::Mat inv_mask;
+    cv::Mat contours;
+    cv::Mat gray;
+    cv::Mat dilated;
+    cv::Mat gray_closing;
+    cv::Mat closing;
+    cv::Mat white;
+    std::vector<float> iris_sizes;
+};
+
+// Drowsiness estimation based on morph. operations and iris extraction
+inline float iris_size(cv::Mat frame) 
+{
+    cv::Size size = frame.size();
+    int height = size.height;
+    int width = size.width;
+
+    cv::Mat frame_resized = frame(cv::Range(5, height-5), cv::Range(5, width-5));
+    int height_resized = height-10;
+    int width_resized = width-10;
+
+    float n_pixels = height_resized * width_resized;
+    float n_blacks = n_pixels - cv::countNonZero(frame_resized);
+
+    return (n_blacks / n_pixels);
+}
+
+// Extent of the dark pixels of a binary eye patch, as measured by iris_correction
+struct DarkExtent {
+    int leftmost;
+    int rightmost;
+    int top;
+    int bottom;
+};
+
+// iris_correction starts from these bounds and only ever moves them outwards
+inline DarkExtent initial_dark_extent(const cv::Mat& frame_eye)
+{
+    DarkExtent extent = {0, frame_eye.cols, 0, frame_eye.rows};
+    return extent;
+}
+
+inline DarkExtent empty_dark_extent()
+{
+    DarkExtent extent = {INT_MAX, INT_MIN, INT_MAX, INT_MIN};
+    return extent;
+}
+
+inline void extend(DarkExtent& extent, int x, int y)
+{
+    extent.leftmost = std::min(extent.leftmost, x);
+    extent.rightmost = std::max(extent.rightmost, x);
+    extent.top = std::min(extent.top, y);
+    extent.bottom = std::max(extent.bottom, y);
+}
+
+inline void extend(DarkExtent& extent, const DarkExtent& other)
+{
+    extent.leftmost = std::min(extent.leftmost, other.leftmost);
+    extent.rightmost = std::max(extent.rightmost, other.rightmost);
+    extent.top = std::min(extent.top, other.top);
+    extent.bottom = std::max(extent.bottom, other.bottom);
+}
+
+// a dark region much wider than high is the eyelid rather than the iris
+inline bool too_flat_for_iris(const DarkExtent& extent)
+{
+    int hdist = extent.rightmost - extent.leftmost;
+    int vdist = extent.bottom - extent.top;
+    double hv_ratio = (double)hdist / (double)vdist;
+    return hv_ratio > 2.3;
+}
+
+// returns frame_eye, or white filled with 255 when the dark region is too flat to be an iris
+inline cv::Mat iris_correction( cv::Mat frame_eye, cv::Mat& white ) {
+    DarkExtent extent = initial_dark_extent(frame_eye);
+
+    cv::Rect dark = zeroPixelBounds(frame_eye);
+    if (!dark.empty()) {
+        extend(extent, dark.x, dark.y);
+        extend(extent, dark.x + dark.width - 1, dark.y + dark.height - 1);
+    }
+
+    cv::Mat frame_eye_new;
+    if (too_flat_for_iris(extent)) {
+        white.create(frame_eye.rows, frame_eye.cols, CV_8UC1);
+        white.setTo(cv::Scalar::all(255));
+        frame_eye_new = white;
+    } else {
+        frame_eye_new = frame_eye;
+    }
+
+    return frame_eye_new;
+}
+
+// Morphological operations used for iris extraction, shared by every threshold. A closing with a flat
+// kernel commutes with thresholding, so closing the grayscale patch once and thresholding
+// the result gives the same image as thresholding first and closing each binary patch.
+inline void prepare_eye(cv::Mat frame_eye_resized, EyeBuffers& buffers)
+{
+    cv::inRange(frame_eye_resized, cv::Scalar(0, 0, 0), cv::Scalar(0, 0, 0), buffers.inv_mask);
+    frame_eye_resized.setTo(cv::Scalar(255, 255, 255), buffers.inv_mask);
+
+    // Contouring eye region
+    cv::bilateralFilter(frame_eye_resized, buffers.contours, 10, 20, 5);
+
+    cv::cvtColor( buffers.contours, buffers.gray, cv::COLOR_BGR2GRAY );
+
+    static const cv::Mat kernel(5,5, CV_8UC1, cv::Scalar::all(255));
+    cv::dilate(buffers.gray, buffers.dilated, kernel);
+
+    cv::erode(buffers.dilated, buffers.gray_closing, kernel);
+}
+
+// Binary eye patch for one threshold, once prepare_eye has run on the patch.
+// The result refers to the scratch images in buffers.
+inline cv::Mat threshold_eye(float threshold, EyeBuffers& buffers)
+{
+    cv::threshold(buffers.gray_closing, buffers.closing, threshold, 255.0, cv::THRESH_BINARY);
+    return iris_correction(buffers.closing, buffers.white);
+}
+
+const int THRESHOLD_MIN = 5;
+const int THRESHOLD_MAX = 95;
+const int THRESHOLD_STEP = 5;
+
+// iris_size of threshold_eye for the thresholds first, first + THRESHOLD_STEP, ... last,
+// from a single pass over the closed patch. A pixel of value v is black for every
+// threshold >= v, so the dark pixel count and the dark extent of each threshold
+// are running totals over the pixel values.
+inline void sweep_iris_sizes(const EyeBuffers& buffers, int first, int last, std::vector<float>& sizes)
+{
+    const cv::Mat& closed = buffers.gray_closing;
+    int value_count[256] = {0};
+    DarkExtent value_extent[256];
+    for (int v = 0; v <= last; v++)
+    {
+        value_extent[v] = empty_dark_extent();
+    }
+
+    // the border of 5 pixels left out by iris_size
+    int inner_top = 5;
+    int inner_bottom = closed.rows - 5;
+    int inner_left = 5;
+    int inner_right = closed.cols - 5;
+    for (int y = 0; y < closed.rows; y++)
+    {
+        const uchar* row = closed.ptr<uchar>(y);
+        bool inner_row = y >= inner_top && y < inner_bottom;
+        for (int x = 0; x < closed.cols; x++)
+        {
+            int v = row[x];
+            if (v > last)
+            {
+                continue;
+            }
+            extend(value_extent[v], x, y);
+            if (inner_row && x >= inner_left && x < inner_right)
+            {
+                value_count[v]++;
+            }
+        }
+    }
+
+    float n_pixels = (inner_bottom - inner_top) * (inner_right - inner_left);
+    DarkExtent extent = initial_dark_extent(closed);
+    int n_blacks = 0;
+    int v = 0;
+    sizes.clear();
+    for (int t = first; t <= last; t += THRESHOLD_STEP)
+    {
+        for (; v <= t; v++)
+        {
+            extend(extent, value_extent[v]);
+            n_blacks += value_count[v];
+        }
+        // a flat dark region is replaced by a white patch without black pixels
+        sizes.push_back(too_flat_for_iris(extent) ? 0 : n_blacks / n_pixels);
+    }
+}
+
+// threshold among first..last whose iris size is closest to the average one,
+// once prepare_eye has run on the patch
+inline float pick_threshold(EyeBuffers& buffers, int first, int last)
+{
+    float average_iris_size = 0.45;
+
+    // applying different thresholds
+    sweep_iris_sizes(buffers, first, last, buffers.iris_sizes);
+
+    float closest_distance = 100;
+    float closest_threshold;
+    for (size_t i = 0; i < buffers.iris_sizes.size(); i++)
+    {
+        float distance = std::abs(average_iris_size - buffers.iris_sizes[i]);
+        if (distance <= closest_distance) 
+        {
+            closest_distance = distance;
+            closest_threshold = first + (int)i * THRESHOLD_STEP;
+        }
+    }
+    
+    return closest_threshold;
+}
+
+// calibration of threshold values used in binarization
+inline float find_best_threshold(cv::Mat eye_frame, EyeBuffers& buffers) 
+{
+    prepare_eye(eye_frame, buffers);
+    return pick_threshold(buffers, THRESHOLD_MIN, THRESHOLD_MAX);
+}
+
+// Threshold calibration carried from frame to frame. Only the neighbourhood of the last
+// threshold is tried, unless the eye patch brightness changed or the best threshold
+// hit the edge of the neighbourhood, which trigger a full sweep.
+struct ThresholdCalibration {
+    bool enabled = false;
+    int radius = 2;                  // neighbouring thresholds tried on each side
+    double max_mean_shift = 12;      // patch brightness change that forces a full sweep
+    double max_stddev_shift = 8;     // patch contrast change that forces a full sweep
+
+    bool valid = false;
+    int threshold = 0;
+    double mean = 0;
+    double stddev = 0;
+};
+
+inline float calibrate_threshold(cv::Mat eye_frame, ThresholdCalibration& calibration, EyeBuffers& buffers)
+{
+    if (!calibration.enabled)
+    {
+        return find_best_threshold(eye_frame, buffers);
+    }
+
+    cv::Scalar channel_mean, channel_stddev;
+    cv::meanStdDev(eye_frame, channel_mean, channel_stddev);
+    double mean = (channel_mean[0] + channel_mean[1] + channel_mean[2]) / 3;
+    double stddev = (channel_stddev[0] + channel_stddev[1] + channel_stddev[2]) / 3;
+
+    bool shifted = std::abs(mean - calibration.mean) > calibration.max_mean_shift ||
+                   std::abs(stddev - calibration.stddev) > calibration.max_stddev_shift;
+
+    prepare_eye(eye_frame, buffers);
+
+    int threshold = 0;
+    if (calibration.valid && !shifted)
+    {
+        int first = std::max(THRESHOLD_MIN, calibration.threshold - calibration.radius * THRESHOLD_STEP);
+        int last = std::min(THRESHOLD_MAX, calibration.threshold + calibration.radius * THRESHOLD_STEP);
+        threshold = pick_threshold(buffers, first, last);
+
+        // the optimum may lie beyond the searched neighbourhood
+        if ((threshold == first && first > THRESHOLD_MIN) || (threshold == last && last < THRESHOLD_MAX))
+        {
+            threshold = 0;
+        }
+    }
+
+    if (threshold == 0)
+    {
+        threshold = pick_threshold(buffers, THRESHOLD_MIN, THRESHOLD_MAX);
+        calibration.mean = mean;
+        calibration.stddev = stddev;
+    }
+
+    calibration.valid = true;
+    calibration.threshold = threshold;
+    return threshold;
+}
+
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef LANDMARK_FLOW_HPP
+#define LANDMARK_FLOW_HPP
+
+#include "opencv2/imgproc.hpp"
+#include "opencv2/video.hpp"
+
+#include <vector>
+
+// Eye and mouth landmarks moved between LBF keyframes with pyramidal Lucas-Kanade flow
+const int FLOW_FIRST_POINT = 36;
+const int FLOW_LAST_POINT = 58;
+
+struct LandmarkFlow {
+    bool enabled = false;
+    int keyframe_interval = 5;       // frames between full landmark fits
+    float max_flow_error = 20;       // mean LK error that forces a re-fit
+    float max_motion = 0.1;          // mean displacement, relative to the face width, that forces a re-fit
+
+    bool valid = false;
+    int frames_since_fit = 0;
+    cv::Mat prev_gray;
+    cv::Rect face;
+    std::vector<cv::Point2f> landmarks;
+
+    std::vector<cv::Point2f> prev_points;
+    std::vector<cv::Point2f> next_points;
+    std::vector<uchar> status;
+    std::vector<float> error;
+};
+
+// Stores the result of a full fit as the new keyframe. Without flow nothing is copied;
+// a flow enabled later, as by the latency governor, starts at the next full fit.
+inline void resetLandmarkFlow(LandmarkFlow& flow, const cv::Mat& gray, const cv::Rect& face,
+                              const std::vector<cv::Point2f>& landmarks)
+{
+    if (!flow.enabled)
+    {
+        flow.valid = false;
+        return;
+    }
+    gray.copyTo(flow.prev_gray);
+    flow.face = face;
+    flow.landmarks = landmarks;
+    flow.frames_since_fit = 0;
+    flow.valid = (int)landmarks.size() > FLOW_LAST_POINT;
+}
+
+// Moves the keyframe landmarks onto gray. Returns false when a full fit is needed instead.
+inline bool propagateLandmarks(LandmarkFlow& flow, const cv::Mat& gray, cv::Rect& face,
+                               std::vector<cv::Point2f>& landmarks)
+{
+    if (!flow.enabled || !flow.valid || flow.frames_since_fit + 1 >= flow.keyframe_interval ||
+        flow.prev_gray.size() != gray.size())
+    {
+        return false;
+    }
+
+    flow.prev_points.assign(flow.landmarks.begin() + FLOW_FIRST_POINT,
+                            flow.landmarks.begin() + FLOW_LAST_POINT + 1);
+    cv::calcOpticalFlowPyrLK(flow.prev_gray, gray, flow.prev_points, flow.next_points,
+                             flow.status, flow.error, cv::Size(21, 21), 3);
+
+    cv::Point2f motion(0, 0);
+    float total_error = 0;
+    for (size_t i = 0; i < flow.next_points.size(); i++)
+    {
+        if (!flow.status[i])
+        {
+            return false;
+        }
+        motion += flow.next_points[i] - flow.prev_points[i];
+        total_error += flow.error[i];
+    }
+
+    float n_points = (float)flow.next_points.size();
+    motion = motion * (1 / n_points);
+    if (total_error / n_points > flow.max_flow_error ||
+        cv::norm(motion) > flow.max_motion * flow.face.width)
+    {
+        return false;
+    }
+
+    // points without flow follow the mean motion of the tracked ones
+    for (size_t i = 0; i < flow.landmarks.size(); i++)
+    {
+        flow.landmarks[i] += motion;
+    }
+    std::copy(flow.next_points.begin(), flow.next_points.end(), flow.landmarks.begin() + FLOW_FIRST_POINT);
+    flow.face.x += cvRound(motion.x);
+    flow.face.y += cvRound(motion.y);
+
+    gray.copyTo(flow.prev_gray);
+    flow.frames_since_fit++;
+
+    face = flow.face;
+    landmarks = flow.landmarks;
+    return true;
+}
+
+#endif
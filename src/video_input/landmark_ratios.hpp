@@ -0,0 +1,145 @@
+#ifndef LANDMARK_RATIOS_HPP
+#define LANDMARK_RATIOS_HPP
+
+#include "opencv2/core.hpp"
+
+#include <cmath>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Indices of the eye and mouth points among the 68 facial landmarks
+const int LEFT_EYE_POINTS[6] = {36, 37, 38, 39, 40, 41};
+const int RIGHT_EYE_POINTS[6] = {42, 43, 44, 45, 46, 47};
+const int MOUTH_INNER[2] = {62, 66};
+const int MOUTH_EDGE_POINTS[6] = {48, 50, 52, 54, 56, 58};
+
+// Width over height of a 6-point eye or mouth outline: corners at 0 and 3, upper lid
+// or lip at 1 and 2, lower at 5 and 4. Open eyes give small values, closed ones large.
+// The single-frame and the batched versions compute it in float with the same operations
+// in the same order, so they agree exactly unless the compiler is allowed to fuse
+// multiply-adds (-mfma with the default -ffp-contract=fast).
+inline float outlineRatio(float x0, float y0, float x1, float y1, float x2, float y2,
+                          float x3, float y3, float x4, float y4, float x5, float y5)
+{
+    float width_x = x0 - x3;
+    float width_y = y0 - y3;
+    float height_x = (x1 + x2) * 0.5f - (x5 + x4) * 0.5f;
+    float height_y = (y1 + y2) * 0.5f - (y5 + y4) * 0.5f;
+    float width = std::sqrt(width_x * width_x + width_y * width_y);
+    float height = std::sqrt(height_x * height_x + height_y * height_y);
+    return width / height;
+}
+
+inline float outlineRatio(const std::vector<cv::Point2f>& landmarks, const int points[])
+{
+    const cv::Point2f* p = &landmarks[0];
+    return outlineRatio(p[points[0]].x, p[points[0]].y, p[points[1]].x, p[points[1]].y,
+                        p[points[2]].x, p[points[2]].y, p[points[3]].x, p[points[3]].y,
+                        p[points[4]].x, p[points[4]].y, p[points[5]].x, p[points[5]].y);
+}
+
+inline float blinkingRatio (const std::vector<cv::Point2f>& landmarks, const int points[])
+{
+    return outlineRatio(landmarks, points);
+}
+
+inline float yawningRatio (const std::vector<cv::Point2f>& landmarks, const int points[])
+{
+    return outlineRatio(landmarks, points);
+}
+
+// Landmarks of many frames or faces in structure-of-arrays layout: x[k][i] is the x of
+// the k-th ratio point of item i. Only the 18 points of the two eyes and the mouth are
+// kept, in the order of RATIO_POINTS.
+const int N_RATIO_POINTS = 18;
+const int RATIO_POINTS[N_RATIO_POINTS] = {
+    36, 37, 38, 39, 40, 41,
+    42, 43, 44, 45, 46, 47,
+    48, 50, 52, 54, 56, 58
+};
+const int LEFT_EYE_OFFSET = 0;
+const int RIGHT_EYE_OFFSET = 6;
+const int MOUTH_OFFSET = 12;
+
+struct RatioBatch {
+    int size = 0;
+    std::vector<float> x[N_RATIO_POINTS];
+    std::vector<float> y[N_RATIO_POINTS];
+
+    std::vector<float> left_eye;
+    std::vector<float> right_eye;
+    std::vector<float> mouth;
+};
+
+inline void resizeBatch(RatioBatch& batch, int size)
+{
+    batch.size = size;
+    for (int k = 0; k < N_RATIO_POINTS; k++)
+    {
+        batch.x[k].resize(size);
+        batch.y[k].resize(size);
+    }
+    batch.left_eye.resize(size);
+    batch.right_eye.resize(size);
+    batch.mouth.resize(size);
+}
+
+// stores the landmarks of item i, as (x, y) pairs of all 68 points
+inline void setBatchItem(RatioBatch& batch, int i, const float (*points)[2])
+{
+    for (int k = 0; k < N_RATIO_POINTS; k++)
+    {
+        batch.x[k][i] = points[RATIO_POINTS[k]][0];
+        batch.y[k][i] = points[RATIO_POINTS[k]][1];
+    }
+}
+
+inline void setBatchItem(RatioBatch& batch, int i, const std::vector<cv::Point2f>& landmarks)
+{
+    for (int k = 0; k < N_RATIO_POINTS; k++)
+    {
+        batch.x[k][i] = landmarks[RATIO_POINTS[k]].x;
+        batch.y[k][i] = landmarks[RATIO_POINTS[k]].y;
+    }
+}
+
+// ratios of the outline starting at offset for items [first, last)
+inline void batchOutlineRatios(const RatioBatch& batch, int offset, int first, int last, float* ratios)
+{
+    const std::vector<float>* x = batch.x + offset;
+    const std::vector<float>* y = batch.y + offset;
+    int i = first;
+#ifdef __SSE2__
+    const __m128 half = _mm_set1_ps(0.5f);
+    for (; i + 4 <= last; i += 4)
+    {
+        __m128 width_x = _mm_sub_ps(_mm_loadu_ps(&x[0][i]), _mm_loadu_ps(&x[3][i]));
+        __m128 width_y = _mm_sub_ps(_mm_loadu_ps(&y[0][i]), _mm_loadu_ps(&y[3][i]));
+        __m128 height_x = _mm_sub_ps(_mm_mul_ps(_mm_add_ps(_mm_loadu_ps(&x[1][i]), _mm_loadu_ps(&x[2][i])), half),
+                                     _mm_mul_ps(_mm_add_ps(_mm_loadu_ps(&x[5][i]), _mm_loadu_ps(&x[4][i])), half));
+        __m128 height_y = _mm_sub_ps(_mm_mul_ps(_mm_add_ps(_mm_loadu_ps(&y[1][i]), _mm_loadu_ps(&y[2][i])), half),
+                                     _mm_mul_ps(_mm_add_ps(_mm_loadu_ps(&y[5][i]), _mm_loadu_ps(&y[4][i])), half));
+        __m128 width = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(width_x, width_x), _mm_mul_ps(width_y, width_y)));
+        __m128 height = _mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(height_x, height_x), _mm_mul_ps(height_y, height_y)));
+        _mm_storeu_ps(ratios + i, _mm_div_ps(width, height));
+    }
+#endif
+    for (; i < last; i++)
+    {
+        ratios[i] = outlineRatio(x[0][i], y[0][i], x[1][i], y[1][i], x[2][i], y[2][i],
+                                 x[3][i], y[3][i], x[4][i], y[4][i], x[5][i], y[5][i]);
+    }
+}
+
+// left eye, right eye and mouth ratios of every item of the batch
+inline void computeBatchRatios(RatioBatch& batch)
+{
+    batchOutlineRatios(batch, LEFT_EYE_OFFSET, 0, batch.size, batch.left_eye.data());
+    batchOutlineRatios(batch, RIGHT_EYE_OFFSET, 0, batch.size, batch.right_eye.data());
+    batchOutlineRatios(batch, MOUTH_OFFSET, 0, batch.size, batch.mouth.data());
+}
+
+#endif
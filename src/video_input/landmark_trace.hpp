@@ -0,0 +1,181 @@
+#ifndef LANDMARK_TRACE_HPP
+#define LANDMARK_TRACE_HPP
+
+#include "opencv2/core.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <fstream>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Binary trace of the face and landmarks of every frame, so the classification and the
+// windows can be re-run without decoding and fitting the video again. The file is a
+// header followed by fixed-size records in the byte order of the machine that wrote
+// it, so frame i is found at a fixed offset of the mapped file.
+const char TRACE_MAGIC[8] = {'L', 'M', 'T', 'R', 'A', 'C', 'E', '2'};
+const int TRACE_POINTS = 68;
+const int TRACE_STREAM_NAME = 256;
+
+// 272 bytes, so the records that follow stay aligned for their double
+struct TraceHeader {
+    char magic[8];
+    uint32_t record_size;
+    uint32_t n_points;
+    char stream[TRACE_STREAM_NAME];  // input the trace was recorded from, zero-padded
+};
+
+struct TraceRecord {
+    double time_ms;
+    int32_t face_found;
+    int32_t face[4];                 // x, y, width, height
+    int32_t passengers;              // passenger faces fitted, -1 when not in passenger mode
+    float points[TRACE_POINTS][2];
+};
+
+class TraceWriter {
+public:
+    // stream_name is what the records of the run carry in their stream field; longer
+    // names are cut to fit the header
+    bool open(const std::string& path, const std::string& stream_name)
+    {
+        file.open(path.c_str(), std::ios::binary | std::ios::trunc);
+        if (!file.is_open())
+        {
+            return false;
+        }
+        TraceHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+        header.record_size = sizeof(TraceRecord);
+        header.n_points = TRACE_POINTS;
+        stream_name.copy(header.stream, TRACE_STREAM_NAME - 1);
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        return file.good();
+    }
+
+    bool isOpen() const
+    {
+        return file.is_open();
+    }
+
+    void append(double time_ms, bool face_found, const cv::Rect& face, const std::vector<cv::Point2f>& landmarks,
+                int passengers = -1)
+    {
+        TraceRecord record;
+        std::memset(&record, 0, sizeof(record));
+        record.time_ms = time_ms;
+        record.passengers = passengers;
+        record.face_found = face_found && (int)landmarks.size() >= TRACE_POINTS;
+        if (record.face_found)
+        {
+            record.face[0] = face.x;
+            record.face[1] = face.y;
+            record.face[2] = face.width;
+            record.face[3] = face.height;
+            for (int i = 0; i < TRACE_POINTS; i++)
+            {
+                record.points[i][0] = landmarks[i].x;
+                record.points[i][1] = landmarks[i].y;
+            }
+        }
+        file.write(reinterpret_cast<const char*>(&record), sizeof(record));
+    }
+
+    void flush()
+    {
+        file.flush();
+    }
+
+private:
+    std::ofstream file;
+};
+
+// Read-only memory map of a trace. Records are read in place, without parsing.
+class TraceReader {
+public:
+    TraceReader() : data(NULL), size(0), n_records(0) {}
+
+    ~TraceReader()
+    {
+        close();
+    }
+
+    bool open(const std::string& path)
+    {
+        close();
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(TraceHeader))
+        {
+            ::close(fd);
+            return false;
+        }
+        size = info.st_size;
+        void* mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapped == MAP_FAILED)
+        {
+            size = 0;
+            return false;
+        }
+        data = static_cast<const char*>(mapped);
+
+        const TraceHeader* header = reinterpret_cast<const TraceHeader*>(data);
+        if (std::memcmp(header->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) != 0 ||
+            header->record_size != sizeof(TraceRecord) || header->n_points != TRACE_POINTS)
+        {
+            close();
+            return false;
+        }
+        // a trace cut short by a crash keeps all of its whole records
+        n_records = (size - sizeof(TraceHeader)) / sizeof(TraceRecord);
+        return true;
+    }
+
+    void close()
+    {
+        if (data != NULL)
+        {
+            munmap(const_cast<char*>(data), size);
+        }
+        data = NULL;
+        size = 0;
+        n_records = 0;
+    }
+
+    size_t frames() const
+    {
+        return n_records;
+    }
+
+    std::string streamName() const
+    {
+        const char* name = reinterpret_cast<const TraceHeader*>(data)->stream;
+        return std::string(name, strnlen(name, TRACE_STREAM_NAME));
+    }
+
+    const TraceRecord& record(size_t i) const
+    {
+        return reinterpret_cast<const TraceRecord*>(data + sizeof(TraceHeader))[i];
+    }
+
+private:
+    TraceReader(const TraceReader&);
+    TraceReader& operator=(const TraceReader&);
+
+    const char* data;
+    size_t size;
+    size_t n_records;
+};
+
+#endif
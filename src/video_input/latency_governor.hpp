@@ -0,0 +1,163 @@
+#ifndef LATENCY_GOVERNOR_HPP
+#define LATENCY_GOVERNOR_HPP
+
+#include "opencv2/videoio.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+
+#include "face_tracker.hpp"
+#include "landmark_flow.hpp"
+#include "stage_profile.hpp"
+
+// Degraded settings the governor steps through when frames take longer than the budget.
+// Level 0 is the configured settings; every level here is applied on top of them and
+// never gives better quality than what was configured.
+struct GovernorLevel {
+    int redetect_interval;           // frames between full-frame face detections
+    float detect_scale;              // full-frame detection resolution
+    int keyframe_interval;           // frames between full landmark fits
+};
+
+const int N_GOVERNOR_LEVELS = 4;
+const GovernorLevel GOVERNOR_LEVELS[N_GOVERNOR_LEVELS] = {
+    {15, 1.0, 1},
+    {30, 0.75, 3},
+    {60, 0.5, 5},
+    {120, 0.5, 10},
+};
+
+// Watches the processing time of every frame and trades detection and fitting rate for
+// latency. The level changes at most once every hold_frames frames, so the running
+// average has time to show the effect of the previous change.
+struct LatencyGovernor {
+    bool enabled = false;
+    double budget_ms = 33;
+    double recover_ratio = 0.6;      // quality is restored below this share of the budget
+    float average_rate = 0.1;        // weight of a new frame in the running average
+    int hold_frames = 30;
+    int max_skip = 4;                // frames a live camera may drop to catch up
+    std::string name;
+
+    int level = 0;
+    double average_ms = 0;
+    double last_ms = 0;
+    int frames_since_change = 0;
+    long skipped = 0;
+
+    bool configured = false;         // the settings of level 0 have been saved
+    FaceTracker base_tracker;
+    LandmarkFlow base_flow;
+};
+
+// time a frame spent in processing; waiting for the camera is not load
+inline double processingMs( const FrameTiming& timing )
+{
+    double total = 0;
+    for (int s = STAGE_CAPTURE + 1; s < N_TIMED_STAGES; s++)
+    {
+        total += std::max(timing.ms[s], 0.0);
+    }
+    return total;
+}
+
+inline void applyGovernorLevel( const LatencyGovernor& governor, FaceTracker& tracker, LandmarkFlow& flow )
+{
+    const FaceTracker& base_tracker = governor.base_tracker;
+    const LandmarkFlow& base_flow = governor.base_flow;
+    tracker.enabled = base_tracker.enabled;
+    tracker.redetect_interval = base_tracker.redetect_interval;
+    tracker.scaled_detection = base_tracker.scaled_detection;
+    tracker.detect_scale = base_tracker.detect_scale;
+    flow.enabled = base_flow.enabled;
+    flow.keyframe_interval = base_flow.keyframe_interval;
+    if (governor.level == 0)
+    {
+        return;
+    }
+
+    const GovernorLevel& degraded = GOVERNOR_LEVELS[governor.level - 1];
+    float base_scale = base_tracker.scaled_detection ? base_tracker.detect_scale : 1.0f;
+    tracker.redetect_interval = base_tracker.enabled ?
+        std::max(base_tracker.redetect_interval, degraded.redetect_interval) : degraded.redetect_interval;
+    tracker.enabled = true;
+    tracker.detect_scale = std::min(base_scale, degraded.detect_scale);
+    tracker.scaled_detection = tracker.detect_scale < 1.0f || base_tracker.scaled_detection;
+    flow.keyframe_interval = base_flow.enabled ?
+        std::max(base_flow.keyframe_interval, degraded.keyframe_interval) : degraded.keyframe_interval;
+    flow.enabled = flow.keyframe_interval > 1;
+}
+
+// Takes the latency of a finished frame into account and changes the tracker and flow
+// settings when the level changes. Returns true on a change.
+inline bool governLatency( LatencyGovernor& governor, const FrameTiming& timing, FaceTracker& tracker,
+                           LandmarkFlow& flow )
+{
+    if (!governor.enabled)
+    {
+        return false;
+    }
+    if (!governor.configured)
+    {
+        governor.base_tracker = tracker;
+        governor.base_flow = flow;
+        governor.configured = true;
+        governor.average_ms = processingMs(timing);
+    }
+
+    governor.last_ms = processingMs(timing);
+    governor.average_ms += governor.average_rate * (governor.last_ms - governor.average_ms);
+    if (++governor.frames_since_change < governor.hold_frames)
+    {
+        return false;
+    }
+
+    int level = governor.level;
+    if (governor.average_ms > governor.budget_ms && level < N_GOVERNOR_LEVELS)
+    {
+        level++;
+    }
+    else if (governor.average_ms < governor.recover_ratio * governor.budget_ms && level > 0)
+    {
+        level--;
+    }
+    if (level == governor.level)
+    {
+        return false;
+    }
+
+    std::cerr << governor.name << (governor.name.empty() ? "" : " ") << "governor: "
+              << (level > governor.level ? "degrading" : "restoring") << " quality to level "
+              << level << " of " << N_GOVERNOR_LEVELS << ", frames take " << governor.average_ms
+              << " ms for a budget of " << governor.budget_ms << " ms" << std::endl;
+    governor.level = level;
+    governor.frames_since_change = 0;
+    applyGovernorLevel(governor, tracker, flow);
+    return true;
+}
+
+// Frames a live camera should drop before the next read, so the next frame analyzed is
+// a current one instead of one that waited in the driver queue while the last one was
+// processed. Recorded videos are never skipped.
+inline int framesToSkip( LatencyGovernor& governor, cv::VideoCapture& capture )
+{
+    if (!governor.enabled || governor.last_ms <= governor.budget_ms ||
+        capture.get(cv::CAP_PROP_FRAME_COUNT) > 0)
+    {
+        return 0;
+    }
+    int skip = std::min((int)(governor.last_ms / governor.budget_ms), governor.max_skip);
+    governor.skipped += skip;
+    return skip;
+}
+
+inline void skipFrames( LatencyGovernor& governor, cv::VideoCapture& capture )
+{
+    for (int n = framesToSkip(governor, capture); n > 0; n--)
+    {
+        capture.grab();
+    }
+}
+
+#endif
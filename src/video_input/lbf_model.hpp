@@ -0,0 +1,121 @@
+#ifndef LBF_MODEL_HPP
+#define LBF_MODEL_HPP
+
+#include "opencv2/core.hpp"
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+// The LBF model as distributed, and the same model with every matrix and number
+// sequence stored as base64 binary blocks, which FileStorage decodes without
+// parsing millions of text floats.
+const char* const LBF_MODEL_YAML = "../models/lbfmodel.yaml";
+const char* const LBF_MODEL_BINARY = "../models/lbfmodel_binary.yaml";
+
+// prefers the converted model when it has been generated
+inline std::string findLbfModel()
+{
+    std::ifstream binary(LBF_MODEL_BINARY);
+    return binary.good() ? LBF_MODEL_BINARY : LBF_MODEL_YAML;
+}
+
+inline bool isMatrixNode(const cv::FileNode& node)
+{
+    return node.isMap() && !node["dt"].empty() && !node["data"].empty();
+}
+
+// FileNode::INT or FileNode::REAL for a flat sequence of numbers, FileNode::NONE otherwise
+inline int numericSequenceType(const cv::FileNode& node)
+{
+    int type = cv::FileNode::INT;
+    for (cv::FileNodeIterator it = node.begin(); it != node.end(); ++it)
+    {
+        if ((*it).isReal())
+        {
+            type = cv::FileNode::REAL;
+        }
+        else if (!(*it).isInt())
+        {
+            return cv::FileNode::NONE;
+        }
+    }
+    return node.size() > 0 ? type : (int)cv::FileNode::NONE;
+}
+
+inline void copyModelNode(cv::FileStorage& out, const cv::FileNode& node, const std::string& name)
+{
+    if (isMatrixNode(node))
+    {
+        cv::Mat matrix;
+        node >> matrix;
+        cv::write(out, name, matrix);
+    }
+    else if (node.isMap())
+    {
+        out.startWriteStruct(name, cv::FileNode::MAP);
+        for (cv::FileNodeIterator it = node.begin(); it != node.end(); ++it)
+        {
+            copyModelNode(out, *it, (*it).name());
+        }
+        out.endWriteStruct();
+    }
+    else if (node.isSeq() && numericSequenceType(node) == cv::FileNode::INT)
+    {
+        std::vector<int> values;
+        node >> values;
+        cv::write(out, name, values);
+    }
+    else if (node.isSeq() && numericSequenceType(node) == cv::FileNode::REAL)
+    {
+        std::vector<double> values;
+        node >> values;
+        cv::write(out, name, values);
+    }
+    else if (node.isSeq())
+    {
+        out.startWriteStruct(name, cv::FileNode::SEQ);
+        for (cv::FileNodeIterator it = node.begin(); it != node.end(); ++it)
+        {
+            copyModelNode(out, *it, "");
+        }
+        out.endWriteStruct();
+    }
+    else if (node.isInt())
+    {
+        cv::write(out, name, (int)node);
+    }
+    else if (node.isReal())
+    {
+        cv::write(out, name, (double)node);
+    }
+    else if (node.isString())
+    {
+        cv::write(out, name, (std::string)node);
+    }
+}
+
+// Rewrites a FileStorage model with base64 payloads. Node names, order and types are kept,
+// so FacemarkLBF::loadModel reads the result exactly like the original.
+inline bool convertLbfModel(const std::string& source, const std::string& target)
+{
+    cv::FileStorage in(source, cv::FileStorage::READ);
+    if (!in.isOpened())
+    {
+        return false;
+    }
+    cv::FileStorage out(target, cv::FileStorage::WRITE_BASE64);
+    if (!out.isOpened())
+    {
+        return false;
+    }
+
+    cv::FileNode root = in.root();
+    for (cv::FileNodeIterator it = root.begin(); it != root.end(); ++it)
+    {
+        copyModelNode(out, *it, (*it).name());
+    }
+    return true;
+}
+
+#endif
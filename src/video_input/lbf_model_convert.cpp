@@ -0,0 +1,28 @@
+#include "opencv2/core.hpp"
+#include <stdio.h>
+
+#include <iostream>
+
+#include "lbf_model.hpp"
+
+using namespace std;
+using namespace cv;
+
+// One-time conversion of the LBF landmark model to the fast-loading binary layout.
+// Usage: ./lbf_model_convert [source.yaml] [target.yaml]
+int main( int argc, const char** argv )
+{
+    String source = argc > 1 ? argv[1] : LBF_MODEL_YAML;
+    String target = argc > 2 ? argv[2] : LBF_MODEL_BINARY;
+
+    int64 start = getTickCount();
+    if ( !convertLbfModel(source, target) )
+    {
+        cerr << "--(!)Error converting " << source << " to " << target << "\n";
+        return -1;
+    }
+    double seconds = (getTickCount() - start) / getTickFrequency();
+
+    cout << "Converted " << source << " to " << target << " in " << seconds << " s" << endl;
+    return 0;
+}
@@ -0,0 +1,287 @@
+#include "opencv2/objdetect.hpp"
+#include "opencv2/imgproc.hpp"
+#include "opencv2/imgcodecs.hpp"
+#include "opencv2/videoio.hpp"
+#include "opencv2/face.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include <algorithm>
+#include <iostream>
+#include <vector>
+
+#include "lbf_model.hpp"
+#include "face_tracker.hpp"
+#include "eye_region.hpp"
+#include "iris_threshold.hpp"
+#include "landmark_ratios.hpp"
+#include "state_writer.hpp"
+
+using namespace std;
+using namespace cv;
+using namespace cv::face;
+
+// Per-stage timing of the detection pipeline over the bundled sample media.
+// Usage: ./stage_benchmark [--frames N] [--repeat N] [--output PATH] [--format jsonl|csv] [inputs...]
+// Inputs ending in .png or .jpg are read as still images, anything else as a video.
+
+enum Stage { GRAY_EQUALIZE, DETECT, FIT, ISOLATE, RATIOS, EYE_PROCESSING, FIND_BEST_THRESHOLD, N_STAGES };
+
+const char* const STAGE_NAMES[N_STAGES] = {
+    "gray_equalize", "detect", "fit", "isolate", "ratios", "eye_processing", "find_best_threshold"
+};
+
+struct Benchmark {
+    CascadeClassifier face_cascade;
+    Ptr<Facemark> facemark;
+    vector<double> stage_ms[N_STAGES];
+    vector<double> frame_ms;  // all stages of the frames where a face was found
+    long frames = 0;
+    long frames_without_face = 0;
+
+    // scratch buffers reused between frames, as in the applications
+    Mat gray;
+    Mat equalized;
+    vector<Rect> faces;
+    vector<Rect> driver_face;
+    vector<vector<Point2f> > shapes;
+    Mat mask;
+    Mat eye;
+    Mat mouth;
+    Mat eye_input;
+    EyeBuffers eye_buffers;
+};
+
+double elapsedMs( int64 start )
+{
+    return (getTickCount() - start) * 1000.0 / getTickFrequency();
+}
+
+void polygon( const vector<Point2f>& landmarks, const int points[], Point region[6] )
+{
+    for (int i = 0; i < 6; i++)
+    {
+        region[i] = Point(landmarks[points[i]].x, landmarks[points[i]].y);
+    }
+}
+
+void benchmarkFrame( Benchmark& bench, const Mat& frame )
+{
+    double stage_ms[N_STAGES];
+    bench.frames++;
+
+    int64 start = getTickCount();
+    cvtColor( frame, bench.gray, COLOR_BGR2GRAY );
+    equalizeHist( bench.gray, bench.equalized );
+    stage_ms[GRAY_EQUALIZE] = elapsedMs(start);
+
+    start = getTickCount();
+    bench.face_cascade.detectMultiScale( bench.equalized, bench.faces );
+    stage_ms[DETECT] = elapsedMs(start);
+
+    bench.stage_ms[GRAY_EQUALIZE].push_back(stage_ms[GRAY_EQUALIZE]);
+    bench.stage_ms[DETECT].push_back(stage_ms[DETECT]);
+    if (bench.faces.empty())
+    {
+        bench.frames_without_face++;
+        return;
+    }
+
+    // only the driver face is fitted, as in the applications
+    start = getTickCount();
+    bench.driver_face.assign(1, bench.faces[largestFace(bench.faces)]);
+    bool fitted = bench.facemark -> fit( frame, bench.driver_face, bench.shapes );
+    stage_ms[FIT] = elapsedMs(start);
+    bench.stage_ms[FIT].push_back(stage_ms[FIT]);
+    if (!fitted)
+    {
+        bench.frames_without_face++;
+        return;
+    }
+    const vector<Point2f>& landmarks = bench.shapes[0];
+
+    start = getTickCount();
+    Point region[6];
+    polygon( landmarks, LEFT_EYE_POINTS, region );
+    isolateRegion( frame, region, 6, 5, bench.mask, bench.eye );
+    polygon( landmarks, MOUTH_EDGE_POINTS, region );
+    isolateRegion( frame, region, 6, 5, bench.mask, bench.mouth );
+    stage_ms[ISOLATE] = elapsedMs(start);
+    if (bench.eye.empty() || bench.mouth.empty())
+    {
+        // a degenerate fit outside the frame leaves nothing for the iris stages
+        bench.frames_without_face++;
+        return;
+    }
+
+    start = getTickCount();
+    volatile float ratios = blinkingRatio( landmarks, LEFT_EYE_POINTS ) +
+                            blinkingRatio( landmarks, RIGHT_EYE_POINTS ) +
+                            yawningRatio( landmarks, MOUTH_EDGE_POINTS );
+    (void)ratios;
+    stage_ms[RATIOS] = elapsedMs(start);
+
+    // both iris stages start from the same untouched eye patch
+    bench.eye.copyTo(bench.eye_input);
+    start = getTickCount();
+    float threshold = find_best_threshold( bench.eye_input, bench.eye_buffers );
+    stage_ms[FIND_BEST_THRESHOLD] = elapsedMs(start);
+
+    bench.eye.copyTo(bench.eye_input);
+    start = getTickCount();
+    prepare_eye( bench.eye_input, bench.eye_buffers );
+    threshold_eye( threshold, bench.eye_buffers );
+    stage_ms[EYE_PROCESSING] = elapsedMs(start);
+
+    double total = 0;
+    for (int s = 0; s < N_STAGES; s++)
+    {
+        if (s > FIT)
+        {
+            bench.stage_ms[s].push_back(stage_ms[s]);
+        }
+        total += stage_ms[s];
+    }
+    bench.frame_ms.push_back(total);
+}
+
+// nearest-rank percentile of sorted values
+double percentile( const vector<double>& sorted, double p )
+{
+    size_t rank = (size_t)ceil(p / 100.0 * sorted.size());
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+void writeStage( StateWriter& writer, const char* name, vector<double> ms )
+{
+    if (ms.empty())
+    {
+        return;
+    }
+    sort(ms.begin(), ms.end());
+    double mean = 0;
+    for (size_t i = 0; i < ms.size(); i++)
+    {
+        mean += ms[i];
+    }
+    mean /= ms.size();
+
+    writer.begin();
+    writer.field("stage", name);
+    writer.field("samples", (long)ms.size());
+    writer.field("mean_ms", mean);
+    writer.field("p50_ms", percentile(ms, 50));
+    writer.field("p99_ms", percentile(ms, 99));
+    writer.field("fps", mean > 0 ? 1000.0 / mean : 0.0);
+    writer.end();
+}
+
+bool isImage( const String& input )
+{
+    String ext = input.size() > 4 ? input.substr(input.size() - 4) : "";
+    return ext == ".png" || ext == ".jpg" || ext == ".PNG" || ext == ".JPG";
+}
+
+int main( int argc, const char** argv )
+{
+    int max_frames = 200;
+    int repeat = 1;
+    String output_path = "-";
+    String output_format = "jsonl";
+    vector<String> inputs;
+
+    for (int i = 1; i < argc; i++)
+    {
+        String arg = argv[i];
+        if (arg == "--frames" && i + 1 < argc)
+        {
+            max_frames = atoi(argv[++i]);
+        }
+        else if (arg == "--repeat" && i + 1 < argc)
+        {
+            repeat = max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--output" && i + 1 < argc)
+        {
+            output_path = argv[++i];
+        }
+        else if (arg == "--format" && i + 1 < argc)
+        {
+            output_format = argv[++i];
+        }
+        else
+        {
+            inputs.push_back(arg);
+        }
+    }
+    if (inputs.empty())
+    {
+        inputs.push_back("../sample_videos/CROPPED.MOV");
+        vector<String> images;
+        glob("../sample_images/*.png", images);
+        inputs.insert(inputs.end(), images.begin(), images.end());
+    }
+
+    StateWriter writer;
+    if ( !writer.open(output_path, output_format) )
+    {
+        cerr << "--(!)Error opening output " << output_path << " as " << output_format << "\n";
+        return -1;
+    }
+
+    Benchmark bench;
+    if( !bench.face_cascade.load( samples::findFile("../haarcascades/haarcascade_frontalface_alt.xml") ) )
+    {
+        cerr << "--(!)Error loading face cascade\n";
+        return -1;
+    };
+    bench.facemark = createFacemarkLBF();
+    bench.facemark -> loadModel(findLbfModel());
+
+    // single-threaded OpenCV, so the numbers compare across machines and builds
+    cv::setNumThreads(1);
+
+    Mat frame;
+    for (size_t i = 0; i < inputs.size(); i++)
+    {
+        if (isImage(inputs[i]))
+        {
+            frame = imread(inputs[i]);
+            if (frame.empty())
+            {
+                cerr << "--(!)Error reading image " << inputs[i] << "\n";
+                continue;
+            }
+            for (int r = 0; r < repeat; r++)
+            {
+                benchmarkFrame( bench, frame );
+            }
+            continue;
+        }
+
+        VideoCapture capture(inputs[i]);
+        if ( !capture.isOpened() )
+        {
+            cerr << "--(!)Error opening video capture " << inputs[i] << "\n";
+            continue;
+        }
+        // decoding happens outside the timed stages
+        for (int n = 0; n < max_frames && capture.read(frame) && !frame.empty(); n++)
+        {
+            for (int r = 0; r < repeat; r++)
+            {
+                benchmarkFrame( bench, frame );
+            }
+        }
+    }
+
+    cerr << bench.frames << " frames, " << bench.frames_without_face << " without a face" << endl;
+    for (int s = 0; s < N_STAGES; s++)
+    {
+        writeStage( writer, STAGE_NAMES[s], bench.stage_ms[s] );
+    }
+    writeStage( writer, "frame", bench.frame_ms );
+    writer.flush();
+    return 0;
+}
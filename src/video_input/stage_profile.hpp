@@ -0,0 +1,179 @@
+#ifndef STAGE_PROFILE_HPP
+#define STAGE_PROFILE_HPP
+
+#include "opencv2/core.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <string>
+
+// Stages of the live processing loop whose latency is recorded
+enum TimedStage {
+    STAGE_CAPTURE,
+    STAGE_GRAY,
+    STAGE_DETECT,
+    STAGE_FIT,
+    STAGE_CLASSIFY,
+    STAGE_RENDER,
+    STAGE_DISPLAY,
+    N_TIMED_STAGES
+};
+
+const char* const TIMED_STAGE_NAMES[N_TIMED_STAGES] = {
+    "capture", "gray", "detect", "fit", "classify", "render", "display"
+};
+
+// Time spent by one frame in every stage; stages the frame did not go through stay negative
+struct FrameTiming {
+    double ms[N_TIMED_STAGES];
+    int64 mark;
+};
+
+inline void startTiming( FrameTiming& timing )
+{
+    std::fill(timing.ms, timing.ms + N_TIMED_STAGES, -1.0);
+    timing.mark = cv::getTickCount();
+}
+
+// charges the time since the previous mark to stage and sets a new mark
+inline void markStage( FrameTiming& timing, TimedStage stage )
+{
+    int64 now = cv::getTickCount();
+    double ms = (now - timing.mark) * 1000.0 / cv::getTickFrequency();
+    timing.ms[stage] = std::max(timing.ms[stage], 0.0) + ms;
+    timing.mark = now;
+}
+
+// sets a new mark without charging the time since the previous one, e.g. after a queue wait
+inline void skipTiming( FrameTiming& timing )
+{
+    timing.mark = cv::getTickCount();
+}
+
+// Fixed buckets of 0.25 ms up to 100 ms, with one more bucket for anything slower,
+// so recording a sample is a single increment.
+const int LATENCY_BUCKETS = 400;
+const double LATENCY_BUCKET_MS = 0.25;
+
+struct LatencyHistogram {
+    long counts[LATENCY_BUCKETS + 1];
+    long samples;
+    double max_ms;
+};
+
+inline void resetHistogram( LatencyHistogram& histogram )
+{
+    std::fill(histogram.counts, histogram.counts + LATENCY_BUCKETS + 1, 0L);
+    histogram.samples = 0;
+    histogram.max_ms = 0;
+}
+
+inline void addSample( LatencyHistogram& histogram, double ms )
+{
+    int bucket = std::min((int)(ms / LATENCY_BUCKET_MS), LATENCY_BUCKETS);
+    histogram.counts[bucket]++;
+    histogram.samples++;
+    histogram.max_ms = std::max(histogram.max_ms, ms);
+}
+
+// upper edge of the bucket holding the p-th percentile, or the slowest sample beyond the buckets
+inline double histogramPercentile( const LatencyHistogram& histogram, double p )
+{
+    long rank = std::max(1L, (long)std::ceil(p / 100.0 * histogram.samples));
+    long seen = 0;
+    for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+    {
+        seen += histogram.counts[bucket];
+        if (seen >= rank)
+        {
+            return std::min((bucket + 1) * LATENCY_BUCKET_MS, histogram.max_ms);
+        }
+    }
+    return histogram.max_ms;
+}
+
+// Per-stage and whole-frame latency of a processing loop. Frames are recorded on the
+// thread that finishes them, and the percentiles of the last interval go to stderr.
+struct StageProfile {
+    bool enabled = false;
+    double budget_ms = 33;          // frames whose stages add up to more are counted
+    double report_interval_s = 10;
+    std::string name;
+
+    LatencyHistogram stages[N_TIMED_STAGES];
+    LatencyHistogram frame;
+    long over_budget = 0;
+    int64 interval_start = 0;
+};
+
+inline void resetProfile( StageProfile& profile )
+{
+    for (int s = 0; s < N_TIMED_STAGES; s++)
+    {
+        resetHistogram(profile.stages[s]);
+    }
+    resetHistogram(profile.frame);
+    profile.over_budget = 0;
+    profile.interval_start = cv::getTickCount();
+}
+
+inline void reportLatency( const std::string& name, const char* stage, const LatencyHistogram& histogram )
+{
+    std::cerr << name << (name.empty() ? "" : " ") << stage
+              << ": p50 " << histogramPercentile(histogram, 50)
+              << " p95 " << histogramPercentile(histogram, 95)
+              << " p99 " << histogramPercentile(histogram, 99)
+              << " max " << histogram.max_ms << " ms" << std::endl;
+}
+
+inline void reportProfile( const StageProfile& profile )
+{
+    for (int s = 0; s < N_TIMED_STAGES; s++)
+    {
+        if (profile.stages[s].samples > 0)
+        {
+            reportLatency(profile.name, TIMED_STAGE_NAMES[s], profile.stages[s]);
+        }
+    }
+    reportLatency(profile.name, "frame", profile.frame);
+    std::cerr << profile.name << (profile.name.empty() ? "" : " ") << "over budget: "
+              << profile.over_budget << " of " << profile.frame.samples
+              << " frames above " << profile.budget_ms << " ms" << std::endl;
+}
+
+inline void recordFrame( StageProfile& profile, const FrameTiming& timing )
+{
+    if (!profile.enabled)
+    {
+        return;
+    }
+    if (profile.interval_start == 0)
+    {
+        resetProfile(profile);
+    }
+
+    double total = 0;
+    for (int s = 0; s < N_TIMED_STAGES; s++)
+    {
+        if (timing.ms[s] >= 0)
+        {
+            addSample(profile.stages[s], timing.ms[s]);
+            total += timing.ms[s];
+        }
+    }
+    addSample(profile.frame, total);
+    if (total > profile.budget_ms)
+    {
+        profile.over_budget++;
+    }
+
+    double elapsed_s = (cv::getTickCount() - profile.interval_start) / cv::getTickFrequency();
+    if (elapsed_s >= profile.report_interval_s)
+    {
+        reportProfile(profile);
+        resetProfile(profile);
+    }
+}
+
+#endif
@@ -0,0 +1,188 @@
+#ifndef STATE_WRITER_HPP
+#define STATE_WRITER_HPP
+
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <vector>
+
+enum OutputFormat { OUTPUT_JSONL, OUTPUT_CSV };
+
+// Machine-readable driver state output, one record per line as JSON Lines or CSV.
+// Records are built field by field; the CSV header is taken from the first record.
+class StateWriter {
+public:
+    StateWriter() : out(NULL), format(OUTPUT_JSONL), header_written(false), n_fields(0) {}
+
+    // path "-" writes to stdout
+    bool open(const std::string& path, const std::string& format_name)
+    {
+        if (format_name == "csv")
+        {
+            format = OUTPUT_CSV;
+        }
+        else if (format_name == "jsonl" || format_name == "json")
+        {
+            format = OUTPUT_JSONL;
+        }
+        else
+        {
+            return false;
+        }
+
+        if (path == "-")
+        {
+            out = &std::cout;
+            return true;
+        }
+        file.open(path.c_str());
+        out = &file;
+        return file.is_open();
+    }
+
+    bool isOpen() const
+    {
+        return out != NULL;
+    }
+
+    void begin()
+    {
+        line.str("");
+        n_fields = 0;
+        if (format == OUTPUT_JSONL)
+        {
+            line << "{";
+        }
+    }
+
+    // Numbers are written with enough digits to read back the same value, so timestamps
+    // of long recordings keep their milliseconds instead of turning into 1e+06.
+    void field(const char* name, double value)
+    {
+        separator(name);
+        line << std::setprecision(std::numeric_limits<double>::max_digits10) << value;
+    }
+
+    void field(const char* name, float value)
+    {
+        separator(name);
+        line << std::setprecision(std::numeric_limits<float>::max_digits10) << value;
+    }
+
+    void field(const char* name, int value)
+    {
+        separator(name);
+        line << value;
+    }
+
+    void field(const char* name, long value)
+    {
+        separator(name);
+        line << value;
+    }
+
+    void field(const char* name, bool value)
+    {
+        separator(name);
+        if (format == OUTPUT_JSONL)
+        {
+            line << (value ? "true" : "false");
+        }
+        else
+        {
+            line << (value ? 1 : 0);
+        }
+    }
+
+    // a value that is not known yet: null in JSON, an empty column in CSV
+    void emptyField(const char* name)
+    {
+        separator(name);
+        if (format == OUTPUT_JSONL)
+        {
+            line << "null";
+        }
+    }
+
+    void field(const char* name, const char* value)
+    {
+        field(name, std::string(value));
+    }
+
+    void field(const char* name, const std::string& value)
+    {
+        separator(name);
+        line << '"';
+        for (size_t i = 0; i < value.size(); i++)
+        {
+            char c = value[i];
+            if (format == OUTPUT_JSONL && (c == '"' || c == '\\'))
+            {
+                line << '\\';
+            }
+            else if (format == OUTPUT_CSV && c == '"')
+            {
+                line << '"';
+            }
+            line << c;
+        }
+        line << '"';
+    }
+
+    void end()
+    {
+        if (format == OUTPUT_JSONL)
+        {
+            line << "}";
+        }
+        else if (!header_written)
+        {
+            for (size_t i = 0; i < names.size(); i++)
+            {
+                *out << (i ? "," : "") << names[i];
+            }
+            *out << "\n";
+            header_written = true;
+        }
+        *out << line.str() << "\n";
+    }
+
+    void flush()
+    {
+        if (out)
+        {
+            out->flush();
+        }
+    }
+
+private:
+    void separator(const char* name)
+    {
+        if (n_fields > 0)
+        {
+            line << ",";
+        }
+        if (format == OUTPUT_JSONL)
+        {
+            line << '"' << name << "\":";
+        }
+        else if (!header_written)
+        {
+            names.push_back(name);
+        }
+        n_fields++;
+    }
+
+    std::ostream* out;
+    std::ofstream file;
+    OutputFormat format;
+    bool header_written;
+    int n_fields;
+    std::vector<std::string> names;
+    std::ostringstream line;
+};
+
+#endif
@@ -0,0 +1,424 @@
+#include "opencv2/core.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include "driver_window.hpp"
+#include "landmark_ratios.hpp"
+#include "landmark_trace.hpp"
+#include "state_writer.hpp"
+
+using namespace std;
+using namespace cv;
+
+// Grid search of the blink and yawn thresholds, the alert window length and the alert
+// level over labeled landmark traces (see --record-trace of ./drowsiness).
+// Usage: ./threshold_search [--blink A:B:STEP] [--yawn A:B:STEP] [--window MS,MS,...]
+//                           [--level A:B:STEP] [--workers N] [--output PATH] [--format jsonl|csv] traces...
+// Grids are given as start:stop:step or as a comma separated list. The labels of a trace
+// are read from the same path with ".labels" appended, one interval per line:
+//     drowsy 125000 131500
+//     yawn 402000 405250
+// with the kind and the start and end times in milliseconds; lines starting with # are skipped.
+
+struct LabelInterval {
+    double start_ms;
+    double end_ms;
+};
+
+// Per-frame ratios and labels of one trace, computed once and shared by every configuration
+struct TraceSeries {
+    String name;
+    vector<double> time_ms;
+    vector<uchar> face_found;
+    vector<float> blinking_ratio;
+    vector<float> yawning_ratio;
+    vector<int> drowsy_event;        // index into drowsy_events, -1 outside them
+    vector<uchar> yawn_label;
+    vector<LabelInterval> drowsy_events;
+};
+
+bool readLabels( const String& path, vector<LabelInterval>& drowsy, vector<LabelInterval>& yawns )
+{
+    ifstream file(path.c_str());
+    if (!file.is_open())
+    {
+        return false;
+    }
+    String line;
+    while (getline(file, line))
+    {
+        if (line.empty() || line[0] == '#')
+        {
+            continue;
+        }
+        istringstream fields(line);
+        String kind;
+        LabelInterval interval;
+        if (!(fields >> kind >> interval.start_ms >> interval.end_ms))
+        {
+            continue;
+        }
+        if (kind == "drowsy")
+        {
+            drowsy.push_back(interval);
+        }
+        else if (kind == "yawn")
+        {
+            yawns.push_back(interval);
+        }
+    }
+    sort(drowsy.begin(), drowsy.end(),
+         [](const LabelInterval& a, const LabelInterval& b) { return a.start_ms < b.start_ms; });
+    return true;
+}
+
+int intervalAt( const vector<LabelInterval>& intervals, double time_ms )
+{
+    for (size_t i = 0; i < intervals.size(); i++)
+    {
+        if (time_ms >= intervals[i].start_ms && time_ms <= intervals[i].end_ms)
+        {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+bool loadSeries( const String& trace_path, TraceSeries& series )
+{
+    TraceReader trace;
+    if (!trace.open(trace_path))
+    {
+        cerr << "--(!)Error reading landmark trace " << trace_path << "\n";
+        return false;
+    }
+    vector<LabelInterval> yawns;
+    if (!readLabels(trace_path + ".labels", series.drowsy_events, yawns))
+    {
+        cerr << "--(!)Error reading labels " << trace_path << ".labels\n";
+        return false;
+    }
+
+    size_t n = trace.frames();
+    series.name = trace_path;
+    series.time_ms.resize(n);
+    series.face_found.resize(n);
+    series.blinking_ratio.resize(n);
+    series.yawning_ratio.resize(n);
+    series.drowsy_event.resize(n);
+    series.yawn_label.resize(n);
+
+    // the same ratios as classifyLandmarks, for the whole trace in one batch
+    RatioBatch batch;
+    resizeBatch(batch, (int)n);
+    for (size_t i = 0; i < n; i++)
+    {
+        const TraceRecord& record = trace.record(i);
+        series.time_ms[i] = record.time_ms;
+        series.face_found[i] = record.face_found != 0;
+        series.drowsy_event[i] = intervalAt(series.drowsy_events, record.time_ms);
+        series.yawn_label[i] = intervalAt(yawns, record.time_ms) >= 0;
+        setBatchItem(batch, (int)i, record.points);
+    }
+    computeBatchRatios(batch);
+    for (size_t i = 0; i < n; i++)
+    {
+        series.blinking_ratio[i] = series.face_found[i] ? (batch.left_eye[i] + batch.right_eye[i]) / 2 : 0;
+        series.yawning_ratio[i] = series.face_found[i] ? batch.mouth[i] : 0;
+    }
+    return true;
+}
+
+// Alert quality of one configuration, summed over all traces
+struct AlertScore {
+    long true_positive = 0;
+    long false_positive = 0;
+    long false_negative = 0;
+    long events = 0;
+    long detected_events = 0;
+    double total_latency_ms = 0;
+    double max_latency_ms = 0;
+};
+
+// Runs the drowsiness window of one blink threshold and window length over a trace and
+// scores the alert at every level. It is the DriverWindow of the applications with its
+// alert horizon set to the window length, fed with the frames that have a face, so a
+// tuned window and level raise the alert on the same frames there.
+void scoreAlerts( const TraceSeries& series, float blinking_threshold, double window_ms,
+                  const vector<float>& levels, vector<AlertScore>& scores,
+                  DriverWindow& window, vector<double>& first_alert )
+{
+    size_t n_levels = levels.size();
+    size_t n_events = series.drowsy_events.size();
+    first_alert.assign(n_levels * n_events, -1.0);
+    setAlertHorizon(window, window_ms);
+    resetWindow(window);
+
+    for (size_t i = 0; i < series.time_ms.size(); i++)
+    {
+        double time_ms = series.time_ms[i];
+        if (series.face_found[i])
+        {
+            updateWindow(window, time_ms, series.blinking_ratio[i] > blinking_threshold, false);
+        }
+
+        int event = series.drowsy_event[i];
+        for (size_t l = 0; l < n_levels; l++)
+        {
+            bool alert = driverAlert(window, levels[l]);
+            AlertScore& score = scores[l];
+            score.true_positive += alert && event >= 0;
+            score.false_positive += alert && event < 0;
+            score.false_negative += !alert && event >= 0;
+            if (alert && event >= 0 && first_alert[l * n_events + event] < 0)
+            {
+                first_alert[l * n_events + event] = time_ms - series.drowsy_events[event].start_ms;
+            }
+        }
+    }
+
+    for (size_t l = 0; l < n_levels; l++)
+    {
+        AlertScore& score = scores[l];
+        score.events += n_events;
+        for (size_t e = 0; e < n_events; e++)
+        {
+            double latency = first_alert[l * n_events + e];
+            if (latency >= 0)
+            {
+                score.detected_events++;
+                score.total_latency_ms += latency;
+                score.max_latency_ms = max(score.max_latency_ms, latency);
+            }
+        }
+    }
+}
+
+struct YawnScore {
+    long true_positive = 0;
+    long false_positive = 0;
+    long false_negative = 0;
+};
+
+YawnScore scoreYawns( const vector<TraceSeries>& traces, float yawning_threshold )
+{
+    YawnScore score;
+    for (size_t t = 0; t < traces.size(); t++)
+    {
+        const TraceSeries& series = traces[t];
+        for (size_t i = 0; i < series.time_ms.size(); i++)
+        {
+            bool yawning = series.face_found[i] && series.yawning_ratio[i] < yawning_threshold;
+            score.true_positive += yawning && series.yawn_label[i];
+            score.false_positive += yawning && !series.yawn_label[i];
+            score.false_negative += !yawning && series.yawn_label[i];
+        }
+    }
+    return score;
+}
+
+double ratioOf( long part, long rest )
+{
+    return part + rest > 0 ? (double)part / (part + rest) : 0.0;
+}
+
+// start:stop:step or a comma separated list
+bool parseGrid( const String& text, vector<float>& values )
+{
+    values.clear();
+    float start, stop, step;
+    if (sscanf(text.c_str(), "%f:%f:%f", &start, &stop, &step) == 3)
+    {
+        if (step <= 0 || stop < start)
+        {
+            return false;
+        }
+        int n = (int)floor((stop - start) / step + 1e-4) + 1;
+        for (int k = 0; k < n; k++)
+        {
+            values.push_back(start + k * step);
+        }
+        return true;
+    }
+    istringstream items(text);
+    String item;
+    while (getline(items, item, ','))
+    {
+        // strtod rather than atof, so an item that is not a finite number is an error instead of 0
+        const char* begin = item.c_str();
+        char* end;
+        double value = strtod(begin, &end);
+        if (end == begin || *end != '\0' || !isfinite(value))
+        {
+            return false;
+        }
+        values.push_back((float)value);
+    }
+    return !values.empty();
+}
+
+int main( int argc, const char** argv )
+{
+    // defaults around the hand-tuned constants: 3.8, 1.7, the 1 s window and 0.8
+    String blink_grid = "3.0:4.6:0.2";
+    String yawn_grid = "1.3:2.1:0.1";
+    String window_grid = "500,1000,2000,5000";
+    String level_grid = "0.5:0.95:0.05";
+    int n_workers = thread::hardware_concurrency();
+    String output_path = "-";
+    String output_format = "jsonl";
+    vector<String> inputs;
+
+    for (int i = 1; i < argc; i++)
+    {
+        String arg = argv[i];
+        if (arg == "--blink" && i + 1 < argc)
+        {
+            blink_grid = argv[++i];
+        }
+        else if (arg == "--yawn" && i + 1 < argc)
+        {
+            yawn_grid = argv[++i];
+        }
+        else if (arg == "--window" && i + 1 < argc)
+        {
+            window_grid = argv[++i];
+        }
+        else if (arg == "--level" && i + 1 < argc)
+        {
+            level_grid = argv[++i];
+        }
+        else if (arg == "--workers" && i + 1 < argc)
+        {
+            n_workers = atoi(argv[++i]);
+        }
+        else if (arg == "--output" && i + 1 < argc)
+        {
+            output_path = argv[++i];
+        }
+        else if (arg == "--format" && i + 1 < argc)
+        {
+            output_format = argv[++i];
+        }
+        else
+        {
+            inputs.push_back(arg);
+        }
+    }
+
+    vector<float> blink_thresholds, yawn_thresholds, windows, levels;
+    if (!parseGrid(blink_grid, blink_thresholds) || !parseGrid(yawn_grid, yawn_thresholds) ||
+        !parseGrid(window_grid, windows) || !parseGrid(level_grid, levels))
+    {
+        cerr << "--(!)Error parsing a grid, expected start:stop:step or a comma separated list\n";
+        return -1;
+    }
+    if (*min_element(windows.begin(), windows.end()) <= 0)
+    {
+        cerr << "--(!)Window lengths must be positive milliseconds\n";
+        return -1;
+    }
+    if (*min_element(levels.begin(), levels.end()) < 0 || *max_element(levels.begin(), levels.end()) > 1)
+    {
+        cerr << "--(!)Alert levels must lie between 0 and 1\n";
+        return -1;
+    }
+    if (inputs.empty())
+    {
+        cerr << "--(!)No landmark traces given\n";
+        return -1;
+    }
+
+    StateWriter writer;
+    if ( !writer.open(output_path, output_format) )
+    {
+        cerr << "--(!)Error opening output " << output_path << " as " << output_format << "\n";
+        return -1;
+    }
+
+    vector<TraceSeries> traces(inputs.size());
+    long n_frames = 0;
+    for (size_t t = 0; t < inputs.size(); t++)
+    {
+        if (!loadSeries(inputs[t], traces[t]))
+        {
+            return -1;
+        }
+        n_frames += traces[t].time_ms.size();
+    }
+
+    // the yawn thresholds do not interact with the alert, so they are scored on their own
+    vector<YawnScore> yawn_scores;
+    for (size_t y = 0; y < yawn_thresholds.size(); y++)
+    {
+        yawn_scores.push_back(scoreYawns(traces, yawn_thresholds[y]));
+    }
+
+    // One job per blink threshold and window length; a single pass of the window over
+    // each trace scores every alert level of the job.
+    size_t n_jobs = blink_thresholds.size() * windows.size();
+    vector<vector<AlertScore> > alert_scores(n_jobs, vector<AlertScore>(levels.size()));
+    atomic<size_t> next_job(0);
+    vector<thread> workers;
+    for (int w = 0; w < max(n_workers, 1); w++)
+    {
+        workers.push_back(thread([&]() {
+            DriverWindow window;
+            vector<double> first_alert;
+            for (size_t job = next_job++; job < n_jobs; job = next_job++)
+            {
+                float blinking_threshold = blink_thresholds[job / windows.size()];
+                double window_ms = windows[job % windows.size()];
+                for (size_t t = 0; t < traces.size(); t++)
+                {
+                    scoreAlerts( traces[t], blinking_threshold, window_ms, levels, alert_scores[job],
+                                 window, first_alert );
+                }
+            }
+        }));
+    }
+    for (size_t w = 0; w < workers.size(); w++)
+    {
+        workers[w].join();
+    }
+
+    for (size_t job = 0; job < n_jobs; job++)
+    {
+        for (size_t l = 0; l < levels.size(); l++)
+        {
+            const AlertScore& alert = alert_scores[job][l];
+            for (size_t y = 0; y < yawn_thresholds.size(); y++)
+            {
+                const YawnScore& yawn = yawn_scores[y];
+                writer.begin();
+                writer.field("blink_threshold", blink_thresholds[job / windows.size()]);
+                writer.field("yawn_threshold", yawn_thresholds[y]);
+                writer.field("window_ms", windows[job % windows.size()]);
+                writer.field("alert_level", levels[l]);
+                writer.field("precision", ratioOf(alert.true_positive, alert.false_positive));
+                writer.field("recall", ratioOf(alert.true_positive, alert.false_negative));
+                writer.field("events", alert.events);
+                writer.field("detected_events", alert.detected_events);
+                writer.field("mean_latency_ms", alert.detected_events > 0 ?
+                             alert.total_latency_ms / alert.detected_events : 0.0);
+                writer.field("max_latency_ms", alert.max_latency_ms);
+                writer.field("yawn_precision", ratioOf(yawn.true_positive, yawn.false_positive));
+                writer.field("yawn_recall", ratioOf(yawn.true_positive, yawn.false_negative));
+                writer.end();
+            }
+        }
+    }
+    writer.flush();
+    cerr << n_frames << " frames in " << traces.size() << " traces, "
+         << n_jobs * levels.size() * yawn_thresholds.size() << " configurations" << endl;
+    return 0;
+}
@@ -0,0 +1,144 @@
+#ifndef YUV_FRAME_HPP
+#define YUV_FRAME_HPP
+
+#include "opencv2/imgproc.hpp"
+#include "opencv2/videoio.hpp"
+
+#include <string>
+
+#include "eye_region.hpp"
+
+// Raw camera frames read with CAP_PROP_CONVERT_RGB off. Detection and landmark fitting
+// only need luma, so the Y plane is used as the gray frame and chroma is converted just
+// for the small patches that are shown.
+//   NV12: CV_8UC1, rows * 3 / 2 high, the Y plane on top of the interleaved UV plane
+//   YUYV: CV_8UC2, Y in the first channel of every pixel
+enum YuvLayout { YUV_NONE, YUV_NV12, YUV_YUYV };
+
+inline YuvLayout parseYuvLayout( const std::string& name )
+{
+    if (name == "nv12")
+    {
+        return YUV_NV12;
+    }
+    if (name == "yuyv")
+    {
+        return YUV_YUYV;
+    }
+    return YUV_NONE;
+}
+
+// asks the camera for raw frames; backends that cannot deliver them keep sending BGR
+inline void requestYuv( cv::VideoCapture& capture, YuvLayout layout )
+{
+    if (layout == YUV_NONE)
+    {
+        return;
+    }
+    int fourcc = layout == YUV_NV12 ? cv::VideoWriter::fourcc('N', 'V', '1', '2')
+                                    : cv::VideoWriter::fourcc('Y', 'U', 'Y', 'V');
+    capture.set(cv::CAP_PROP_FOURCC, fourcc);
+    capture.set(cv::CAP_PROP_CONVERT_RGB, 0);
+}
+
+// Layout of a captured frame: the requested one if the frame has its shape, YUV_NONE
+// for BGR. Returns false for any other frame, such as a raw buffer of a layout that was
+// not requested, which the analysis cannot read.
+inline bool frameLayout( const cv::Mat& frame, YuvLayout requested, YuvLayout& layout )
+{
+    if (requested == YUV_NV12 && frame.type() == CV_8UC1 && frame.rows % 3 == 0)
+    {
+        layout = YUV_NV12;
+        return true;
+    }
+    if (requested == YUV_YUYV && frame.type() == CV_8UC2)
+    {
+        layout = YUV_YUYV;
+        return true;
+    }
+    layout = YUV_NONE;
+    return frame.type() == CV_8UC3;
+}
+
+// error message for a frame frameLayout rejected
+inline std::string unsupportedFrame( const cv::Mat& frame )
+{
+    return "Unsupported frame of " + std::to_string(frame.cols) + "x" + std::to_string(frame.rows) +
+           " with " + std::to_string(frame.channels()) + " channel(s) of " + std::to_string(8 * frame.elemSize1()) +
+           " bits, expected BGR or the layout asked for with --yuv";
+}
+
+inline cv::Size yuvFrameSize( const cv::Mat& frame, YuvLayout layout )
+{
+    if (layout == YUV_NV12)
+    {
+        return cv::Size(frame.cols, frame.rows * 2 / 3);
+    }
+    return frame.size();
+}
+
+// Gray image of a frame. The NV12 Y plane is referenced without a copy; YUYV luma is
+// gathered into buffer, and BGR frames are converted into buffer.
+inline void lumaPlane( const cv::Mat& frame, YuvLayout layout, cv::Mat& buffer, cv::Mat& gray )
+{
+    if (layout == YUV_NV12)
+    {
+        gray = frame.rowRange(0, frame.rows * 2 / 3);
+        return;
+    }
+    cv::cvtColor(frame, buffer, layout == YUV_YUYV ? cv::COLOR_YUV2GRAY_YUYV : cv::COLOR_BGR2GRAY);
+    gray = buffer;
+}
+
+// BGR pixels of box only. The box is grown to even coordinates, as chroma covers
+// 2x2 (NV12) or 2x1 (YUYV) pixels; aligned receives the box that was converted.
+inline void yuvRoiToBgr( const cv::Mat& frame, YuvLayout layout, const cv::Rect& box,
+                         cv::Mat& bgr, cv::Rect& aligned )
+{
+    cv::Size size = yuvFrameSize(frame, layout);
+    int x0 = box.x & ~1;
+    int y0 = layout == YUV_NV12 ? box.y & ~1 : box.y;
+    int x1 = std::min(size.width, (box.x + box.width + 1) & ~1);
+    int y1 = layout == YUV_NV12 ? std::min(size.height, (box.y + box.height + 1) & ~1) : box.y + box.height;
+    aligned = cv::Rect(x0, y0, x1 - x0, y1 - y0);
+
+    if (layout == YUV_NV12)
+    {
+        cv::Mat y_plane = frame.rowRange(0, size.height);
+        cv::Mat uv_plane(size.height / 2, size.width / 2, CV_8UC2,
+                         const_cast<uchar*>(frame.ptr(size.height)), frame.step);
+        cv::Rect uv_box(aligned.x / 2, aligned.y / 2, aligned.width / 2, aligned.height / 2);
+        cv::cvtColorTwoPlane(y_plane(aligned), uv_plane(uv_box), bgr, cv::COLOR_YUV2BGR_NV12);
+    }
+    else
+    {
+        cv::cvtColor(frame(aligned), bgr, cv::COLOR_YUV2BGR_YUYV);
+    }
+}
+
+// isolateRegion for a raw frame: only the region's box is converted to BGR
+const int MAX_REGION_POINTS = 16;
+
+inline void isolateYuvRegion( const cv::Mat& frame, YuvLayout layout, const cv::Point* polygon, int n_points,
+                              int margin, cv::Mat& mask, cv::Mat& roi, cv::Mat& patch )
+{
+    CV_Assert(n_points <= MAX_REGION_POINTS);
+    cv::Rect box = regionBox(polygon, n_points, margin, yuvFrameSize(frame, layout));
+    if (box.empty())
+    {
+        patch.release();
+        return;
+    }
+    cv::Rect aligned;
+    yuvRoiToBgr(frame, layout, box, roi, aligned);
+
+    // the polygon in roi coordinates; the isolated box is the same as in the full frame
+    cv::Point shifted[MAX_REGION_POINTS];
+    for (int i = 0; i < n_points; i++)
+    {
+        shifted[i] = polygon[i] - aligned.tl();
+    }
+    isolateRegion(roi, shifted, n_points, margin, mask, patch);
+}
+
+#endif
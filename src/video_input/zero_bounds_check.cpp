@@ -0,0 +1,94 @@
+#include "opencv2/core.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#include <iostream>
+
+#include "eye_region.hpp"
+
+using namespace std;
+using namespace cv;
+
+// Checks zeroPixelBounds against a plain per-pixel scan over random binary patches.
+// Usage: ./zero_bounds_check [patches]
+// Prints the first mismatches to stderr and exits with 1 when there is any.
+
+// reference: every pixel read with at<uchar>
+Rect naiveZeroBounds( const Mat& binary )
+{
+    int min_x = INT_MAX, max_x = -1, min_y = INT_MAX, max_y = -1;
+    for (int y = 0; y < binary.rows; y++)
+    {
+        for (int x = 0; x < binary.cols; x++)
+        {
+            if (binary.at<uchar>(y, x) == 0)
+            {
+                min_x = min(min_x, x);
+                max_x = max(max_x, x);
+                min_y = min(min_y, y);
+                max_y = max(max_y, y);
+            }
+        }
+    }
+    if (max_y < 0)
+    {
+        return Rect();
+    }
+    return Rect(min_x, min_y, max_x - min_x + 1, max_y - min_y + 1);
+}
+
+// Random patch of the given size: zeros at the given density per mille, some rows
+// without any zero, and a view into a wider image every other time, so rows are not contiguous.
+Mat randomPatch( int rows, int cols, int density, Mat& storage )
+{
+    bool view = rand() % 2 == 0;
+    int offset = view ? 1 + rand() % 7 : 0;
+    storage.create(rows, cols + (view ? offset + rand() % 9 : 0), CV_8UC1);
+    for (int y = 0; y < storage.rows; y++)
+    {
+        bool no_zeros = rand() % 4 == 0;
+        uchar* row = storage.ptr<uchar>(y);
+        for (int x = 0; x < storage.cols; x++)
+        {
+            row[x] = !no_zeros && rand() % 1000 < density ? 0 : 255;
+        }
+    }
+    return storage(Rect(offset, 0, cols, rows));
+}
+
+int main( int argc, const char** argv )
+{
+    int n_patches = argc > 1 ? atoi(argv[1]) : 100000;
+    srand(12345);
+
+    // widths around the 16-pixel blocks of the SSE2 scan and the usual eye patch sizes
+    const int widths[] = {1, 2, 7, 15, 16, 17, 31, 32, 33, 47, 48, 49, 63, 64, 65, 100, 127, 130};
+    const int n_widths = sizeof(widths) / sizeof(widths[0]);
+    const int densities[] = {0, 1, 10, 100, 500, 990, 1000};
+    const int n_densities = sizeof(densities) / sizeof(densities[0]);
+
+    Mat storage;
+    int failures = 0;
+    for (int i = 0; i < n_patches; i++)
+    {
+        int cols = i % 2 ? widths[rand() % n_widths] : 1 + rand() % 140;
+        int rows = 1 + rand() % 40;
+        int density = densities[rand() % n_densities];
+        Mat patch = randomPatch(rows, cols, density, storage);
+
+        Rect expected = naiveZeroBounds(patch);
+        Rect found = zeroPixelBounds(patch);
+        if (found != expected)
+        {
+            if (++failures <= 10)
+            {
+                cerr << "--(!)Mismatch on a " << cols << "x" << rows << " patch: expected " << expected
+                     << ", got " << found << "\n";
+            }
+        }
+    }
+
+    cerr << n_patches << " patches, " << failures << " failures" << endl;
+    return failures > 0 ? 1 : 0;
+}